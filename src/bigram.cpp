@@ -0,0 +1,54 @@
+#include "bigram.h"
+#include <cstring>
+#include <stdexcept>
+
+namespace fcitx::hallelujah {
+
+void BigramModel::load(const std::string &path) {
+    MappedFile file;
+    file.open(path);
+    const auto *data = file.data();
+    auto size = file.size();
+    const auto *header =
+        reinterpret_cast<const format::BigramFileHeader *>(data);
+    auto inside = [size](uint64_t offset, uint64_t length) {
+        return offset <= size && length <= size - offset;
+    };
+    if (size < sizeof(format::BigramFileHeader) ||
+        std::memcmp(header->magic, format::BigramMagic,
+                    sizeof(format::BigramMagic)) != 0 ||
+        header->version != format::BigramVersion ||
+        !inside(header->offsetsOffset,
+                (uint64_t(header->numKeys) + 1) * sizeof(uint32_t)) ||
+        !inside(header->entriesOffset, uint64_t(header->numEntries) *
+                                           sizeof(format::BigramEntry))) {
+        throw std::runtime_error("Invalid " + path);
+    }
+    file.adviseRandom();
+
+    file_ = std::move(file);
+    header_ = header;
+    offsets_ = reinterpret_cast<const uint32_t *>(data + header->offsetsOffset);
+    entries_ = reinterpret_cast<const format::BigramEntry *>(
+        data + header->entriesOffset);
+}
+
+void BigramModel::predict(uint32_t id, size_t limit,
+                          std::vector<uint32_t> &result) const {
+    result.clear();
+    if (id >= numKeys()) {
+        return;
+    }
+    auto begin = offsets_[id];
+    auto end = offsets_[id + 1];
+    if (begin > end || end > header_->numEntries) {
+        return;
+    }
+    for (auto i = begin; i < end && result.size() < limit; ++i) {
+        if (entries_[i].id < header_->numKeys) {
+            result.push_back(entries_[i].id);
+        }
+    }
+}
+
+} // namespace fcitx::hallelujah
@@ -0,0 +1,38 @@
+#ifndef _FCITX5_HALLELUJAH_BIGRAM_H_
+#define _FCITX5_HALLELUJAH_BIGRAM_H_
+
+#include "dictformat.h"
+#include "wordstore.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fcitx::hallelujah {
+
+// Next-word model served straight out of a mapped bigram.bin. Only the
+// header is checked on load and every lookup checks its own bounds, so a
+// lookup touches no more than the pages holding that key's followers.
+class BigramModel {
+public:
+    // Throws std::runtime_error if the file is missing or malformed.
+    void load(const std::string &path);
+
+    bool empty() const { return !header_; }
+    uint32_t numKeys() const { return header_ ? header_->numKeys : 0; }
+    // Replaces result with up to limit key IDs most likely to follow id,
+    // most likely first.
+    void predict(uint32_t id, size_t limit,
+                 std::vector<uint32_t> &result) const;
+    size_t mappedSize() const { return file_.size(); }
+
+private:
+    MappedFile file_;
+    const format::BigramFileHeader *header_ = nullptr;
+    const uint32_t *offsets_ = nullptr;
+    const format::BigramEntry *entries_ = nullptr;
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
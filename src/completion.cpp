@@ -0,0 +1,536 @@
+#include "completion.h"
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+namespace fcitx::hallelujah {
+
+namespace {
+
+template <typename T>
+void appendArray(std::string &image, const std::vector<T> &v) {
+    image.append(reinterpret_cast<const char *>(v.data()),
+                 v.size() * sizeof(T));
+}
+
+} // namespace
+
+std::string CompletionIndex::serialize(const marisa::Trie &trie,
+                                       const FrequencyFunc &frequency) {
+    auto n = static_cast<uint32_t>(trie.num_keys());
+    std::vector<std::string> keys(n);
+    marisa::Agent agent;
+    for (uint32_t id = 0; id < n; ++id) {
+        agent.set_query(id);
+        trie.reverse_lookup(agent);
+        keys[id].assign(agent.key().ptr(), agent.key().length());
+    }
+
+    std::vector<uint32_t> ids(n);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::sort(ids.begin(), ids.end(),
+              [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+
+    std::vector<double> frequencies;
+    std::vector<uint32_t> offsets;
+    std::string sortedKeys;
+    frequencies.reserve(n);
+    offsets.reserve(n + 1);
+    offsets.push_back(0);
+    for (auto id : ids) {
+        frequencies.push_back(frequency(keys[id], id));
+        sortedKeys += keys[id];
+        offsets.push_back(sortedKeys.size());
+    }
+
+    // Bottom-up, each inner node holding the better rank of its children
+    // in the order of better().
+    std::vector<uint32_t> tree(2 * n);
+    std::iota(tree.begin() + n, tree.end(), 0);
+    for (auto i = n; i-- > 1;) {
+        auto l = tree[2 * i];
+        auto r = tree[2 * i + 1];
+        auto better = frequencies[l] != frequencies[r]
+                          ? frequencies[l] > frequencies[r]
+                          : l > r;
+        tree[i] = better ? l : r;
+    }
+
+    format::CompletionFileHeader header{};
+    std::memcpy(header.magic, format::CompletionMagic, sizeof(header.magic));
+    header.version = format::CompletionVersion;
+    header.numKeys = n;
+    header.keysSize = sortedKeys.size();
+    header.frequenciesOffset = sizeof(header);
+    header.idsOffset = header.frequenciesOffset + n * sizeof(double);
+    header.treeOffset = header.idsOffset + n * sizeof(uint32_t);
+    header.offsetsOffset = header.treeOffset + 2 * n * sizeof(uint32_t);
+    header.keysOffset = header.offsetsOffset + (n + 1) * sizeof(uint32_t);
+    std::string image;
+    image.reserve(header.keysOffset + header.keysSize);
+    image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    appendArray(image, frequencies);
+    appendArray(image, ids);
+    appendArray(image, tree);
+    appendArray(image, offsets);
+    image += sortedKeys;
+    return image;
+}
+
+void CompletionIndex::load(const std::string &path) {
+    MappedFile file;
+    file.open(path);
+    attach(file.data(), file.size(), path);
+    file_ = std::move(file);
+    image_.clear();
+}
+
+void CompletionIndex::build(const marisa::Trie &trie,
+                            const FrequencyFunc &frequency) {
+    clear();
+    // Moving a string may move its buffer, so it is attached once in place.
+    image_ = serialize(trie, frequency);
+    try {
+        attach(image_.data(), image_.size(), "completion index");
+    } catch (...) {
+        clear();
+        throw;
+    }
+}
+
+void CompletionIndex::clear() {
+    file_.close();
+    image_.clear();
+    header_ = nullptr;
+    frequencies_ = nullptr;
+    ids_ = nullptr;
+    tree_ = nullptr;
+    offsets_ = nullptr;
+    keys_ = nullptr;
+}
+
+void CompletionIndex::attach(const char *data, size_t size,
+                             const std::string &name) {
+    auto fail = [&name]() { throw std::runtime_error("Invalid " + name); };
+    if (size < sizeof(format::CompletionFileHeader)) {
+        fail();
+    }
+    const auto *header =
+        reinterpret_cast<const format::CompletionFileHeader *>(data);
+    if (std::memcmp(header->magic, format::CompletionMagic,
+                    sizeof(format::CompletionMagic)) != 0 ||
+        header->version != format::CompletionVersion) {
+        fail();
+    }
+    auto inside = [size](uint64_t offset, uint64_t length) {
+        return offset <= size && length <= size - offset;
+    };
+    uint64_t n = header->numKeys;
+    if (!inside(header->frequenciesOffset, n * sizeof(double)) ||
+        !inside(header->idsOffset, n * sizeof(uint32_t)) ||
+        !inside(header->treeOffset, 2 * n * sizeof(uint32_t)) ||
+        !inside(header->offsetsOffset, (n + 1) * sizeof(uint32_t)) ||
+        !inside(header->keysOffset, header->keysSize) ||
+        header->frequenciesOffset % alignof(double) ||
+        header->idsOffset % alignof(uint32_t) ||
+        header->treeOffset % alignof(uint32_t) ||
+        header->offsetsOffset % alignof(uint32_t)) {
+        fail();
+    }
+    const auto *ids =
+        reinterpret_cast<const uint32_t *>(data + header->idsOffset);
+    const auto *tree =
+        reinterpret_cast<const uint32_t *>(data + header->treeOffset);
+    const auto *offsets =
+        reinterpret_cast<const uint32_t *>(data + header->offsetsOffset);
+    // The root of the tree is node 1, so node 0 is never read.
+    if (offsets[0] != 0 || offsets[n] != header->keysSize ||
+        !std::all_of(ids, ids + n, [n](uint32_t id) { return id < n; }) ||
+        (n && !std::all_of(tree + 1, tree + 2 * n,
+                           [n](uint32_t rank) { return rank < n; })) ||
+        !std::is_sorted(offsets, offsets + n + 1)) {
+        fail();
+    }
+    header_ = header;
+    frequencies_ =
+        reinterpret_cast<const double *>(data + header->frequenciesOffset);
+    ids_ = ids;
+    tree_ = tree;
+    offsets_ = offsets;
+    keys_ = data + header->keysOffset;
+}
+
+CompletionRange CompletionIndex::narrow(CompletionRange range,
+                                        std::string_view prefix) const {
+    auto lower = [this, prefix](uint32_t rank) { return key(rank) < prefix; };
+    auto matches = [this, prefix](uint32_t rank) {
+        return key(rank).substr(0, prefix.size()) == prefix;
+    };
+    uint32_t begin = range.begin;
+    uint32_t end = range.end;
+    // Partition points over ranks: first key >= prefix, then first key past
+    // the ones starting with prefix.
+    while (begin < end) {
+        auto mid = begin + (end - begin) / 2;
+        if (lower(mid)) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    auto first = begin;
+    end = range.end;
+    while (begin < end) {
+        auto mid = begin + (end - begin) / 2;
+        if (matches(mid)) {
+            begin = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return {first, begin};
+}
+
+bool CompletionIndex::find(std::string_view key, uint32_t &rank) const {
+    auto found = range(key);
+    if (found.empty() || this->key(found.begin) != key) {
+        return false;
+    }
+    rank = found.begin;
+    return true;
+}
+
+uint32_t CompletionIndex::best(CompletionRange range) const {
+    auto n = size();
+    auto l = range.begin + n;
+    auto r = range.end + n;
+    auto result = range.begin;
+    while (l < r) {
+        if (l & 1) {
+            auto candidate = tree_[l++];
+            if (better(candidate, result)) {
+                result = candidate;
+            }
+        }
+        if (r & 1) {
+            auto candidate = tree_[--r];
+            if (better(candidate, result)) {
+                result = candidate;
+            }
+        }
+        l >>= 1;
+        r >>= 1;
+    }
+    return result;
+}
+
+void CompletionIndex::nextLetters(CompletionRange range, size_t depth,
+                                  size_t limit, std::string &letters) const {
+    letters.clear();
+    auto rank = range.begin;
+    // The prefix itself sorts first.
+    if (rank < range.end && key(rank).size() == depth) {
+        ++rank;
+    }
+    // One entry per child, with the best rank below it.
+    std::vector<std::pair<uint32_t, char>> children;
+    while (rank < range.end) {
+        auto c = key(rank)[depth];
+        auto begin = rank;
+        auto end = range.end;
+        while (rank < end) {
+            auto mid = rank + (end - rank) / 2;
+            if (key(mid)[depth] == c) {
+                rank = mid + 1;
+            } else {
+                end = mid;
+            }
+        }
+        children.emplace_back(best({begin, rank}), c);
+    }
+    auto count = std::min(limit, children.size());
+    std::partial_sort(children.begin(), children.begin() + count,
+                      children.end(), [this](const auto &a, const auto &b) {
+                          return better(a.first, b.first);
+                      });
+    for (size_t i = 0; i < count; ++i) {
+        letters += children[i].second;
+    }
+}
+
+bool CompletionCursor::Compare::operator()(const Entry &a,
+                                           const Entry &b) const {
+    return index->better(b.best, a.best);
+}
+
+CompletionCursor::CompletionCursor(const CompletionIndex &index,
+                                   CompletionRange range,
+                                   std::string_view prefix)
+    : index_(index), queue_(Compare{&index}) {
+    if (range.empty()) {
+        return;
+    }
+    // The prefix itself sorts first in its range.
+    if (index_.key(range.begin).size() == prefix.size()) {
+        exact_ = range.begin;
+        ++range.begin;
+    }
+    push(range);
+}
+
+CompletionCursor::CompletionCursor(const CompletionIndex &index,
+                                   const std::vector<CompletionRange> &ranges)
+    : index_(index), queue_(Compare{&index}) {
+    for (auto range : ranges) {
+        push(range);
+    }
+}
+
+bool CompletionCursor::next(uint32_t &rank) {
+    if (exact_ >= 0) {
+        rank = exact_;
+        exact_ = -1;
+        return true;
+    }
+    if (queue_.empty()) {
+        return false;
+    }
+    auto entry = queue_.top();
+    queue_.pop();
+    rank = entry.best;
+    push({entry.range.begin, entry.best});
+    push({entry.best + 1, entry.range.end});
+    return true;
+}
+
+void CompletionCursor::push(CompletionRange range) {
+    if (!range.empty()) {
+        queue_.push({index_.best(range), range});
+    }
+}
+
+void mergeCompletions(const std::vector<const CompletionIndex *> &layers,
+                      const std::vector<uint32_t> &first,
+                      std::string_view prefix, size_t limit,
+                      std::vector<LayeredRank> &result) {
+    result.clear();
+    // Head of every stream. There are only a handful of layers, so the best
+    // head is found by scanning them rather than with a heap.
+    struct Head {
+        bool valid;
+        uint32_t rank;
+    };
+    std::vector<CompletionCursor> cursors;
+    std::vector<Head> heads(layers.size(), Head{false, 0});
+    size_t position = 0;
+    auto advance = [&](size_t layer) {
+        auto &head = heads[layer];
+        if (layer == 0) {
+            head.valid = position < first.size();
+            head.rank = head.valid ? first[position++] : 0;
+        } else {
+            head.valid = cursors[layer - 1].next(head.rank);
+        }
+    };
+    cursors.reserve(layers.size());
+    for (size_t layer = 0; layer < layers.size(); ++layer) {
+        if (layer > 0) {
+            cursors.emplace_back(*layers[layer], prefix);
+        }
+        advance(layer);
+    }
+    auto better = [&](size_t a, size_t b) {
+        auto rankA = heads[a].rank;
+        auto rankB = heads[b].rank;
+        bool exactA = layers[a]->key(rankA).size() == prefix.size();
+        bool exactB = layers[b]->key(rankB).size() == prefix.size();
+        if (exactA != exactB) {
+            return exactA;
+        }
+        return layers[a]->frequency(rankA) > layers[b]->frequency(rankB);
+    };
+    while (result.size() < limit) {
+        size_t best = layers.size();
+        for (size_t layer = 0; layer < layers.size(); ++layer) {
+            if (heads[layer].valid && (best == layers.size() ||
+                                       better(layer, best))) {
+                best = layer;
+            }
+        }
+        if (best == layers.size()) {
+            break;
+        }
+        auto key = layers[best]->key(heads[best].rank);
+        if (std::none_of(result.begin(), result.end(),
+                         [&layers, key](const LayeredRank &item) {
+                             return layers[item.layer]->key(item.rank) == key;
+                         })) {
+            result.push_back({static_cast<uint32_t>(best), heads[best].rank});
+        }
+        advance(best);
+    }
+}
+
+namespace {
+
+// Depth-first walk keeping one row of the optimal string alignment distance
+// matrix per depth: rows_[d][j] is the distance between the first d letters
+// of the current prefix and the first j letters of the query.
+class FuzzyWalk {
+public:
+    FuzzyWalk(const CompletionIndex &index, std::string_view query,
+              uint32_t maxDistance, Deadline &deadline)
+        : index_(index), query_(query), maxDistance_(maxDistance),
+          deadline_(deadline), levels_(maxDistance + 1) {
+        auto &row = rows_.emplace_back(query.size() + 1);
+        std::iota(row.begin(), row.end(), 0);
+    }
+
+    // Ranges whose prefix is within j edits of the query, grouped by j.
+    // A range is left out if an enclosing one is already at most as far.
+    std::vector<std::vector<CompletionRange>> run() {
+        visit(index_.all(), 0, maxDistance_ + 1);
+        return std::move(levels_);
+    }
+
+private:
+    void visit(CompletionRange range, uint32_t depth, uint32_t covered) {
+        auto rank = range.begin;
+        // The node's own key sorts first.
+        if (rank < range.end && index_.key(rank).size() == depth) {
+            ++rank;
+        }
+        while (rank < range.end && !deadline_.expired()) {
+            auto c = index_.key(rank)[depth];
+            // Children are contiguous runs of the letter at depth. Most are
+            // small, so the end of a run is found by galloping from its
+            // start rather than by bisecting the whole range.
+            auto begin = rank;
+            auto inRun = [this, depth, c](uint32_t rank) {
+                return index_.key(rank)[depth] == c;
+            };
+            uint32_t step = 1;
+            while (step < range.end - begin && inRun(begin + step)) {
+                step *= 2;
+            }
+            rank = begin + step / 2 + 1;
+            auto end = begin + std::min(step, range.end - begin);
+            while (rank < end) {
+                auto mid = rank + (end - rank) / 2;
+                if (inRun(mid)) {
+                    rank = mid + 1;
+                } else {
+                    end = mid;
+                }
+            }
+            visitChild({begin, rank}, depth, c, covered);
+        }
+    }
+
+    void visitChild(CompletionRange range, uint32_t depth, char c,
+                    uint32_t covered) {
+        auto m = query_.size();
+        if (rows_.size() <= depth + 1) {
+            rows_.emplace_back(m + 1);
+        }
+        const auto &prev = rows_[depth];
+        auto &row = rows_[depth + 1];
+        row[0] = depth + 1;
+        auto best = row[0];
+        for (size_t j = 1; j <= m; ++j) {
+            uint32_t cost = query_[j - 1] == c ? 0 : 1;
+            row[j] =
+                std::min({prev[j] + 1, row[j - 1] + 1, prev[j - 1] + cost});
+            if (j > 1 && depth > 0 && query_[j - 1] == prefix_[depth - 1] &&
+                query_[j - 2] == c) {
+                row[j] = std::min(row[j], rows_[depth - 1][j - 2] + 1);
+            }
+            best = std::min(best, row[j]);
+        }
+        if (best > maxDistance_) {
+            return;
+        }
+        if (row[m] < covered) {
+            levels_[row[m]].push_back(range);
+            covered = row[m];
+        }
+        // Deeper prefixes can still come closer to the query.
+        if (covered > 0) {
+            prefix_.resize(depth);
+            prefix_.push_back(c);
+            visit(range, depth + 1, covered);
+        }
+    }
+
+    const CompletionIndex &index_;
+    std::string_view query_;
+    uint32_t maxDistance_;
+    Deadline &deadline_;
+    std::string prefix_;
+    std::vector<std::vector<uint32_t>> rows_;
+    std::vector<std::vector<CompletionRange>> levels_;
+};
+
+} // namespace
+
+std::vector<uint32_t> fuzzyComplete(const CompletionIndex &index,
+                                    std::string_view query,
+                                    uint32_t maxDistance, size_t limit,
+                                    Deadline &deadline) {
+    std::vector<uint32_t> result;
+    if (index.empty()) {
+        return result;
+    }
+    auto levels = FuzzyWalk(index, query, maxDistance, deadline).run();
+    for (const auto &ranges : levels) {
+        // Keys nested in a closer range were emitted with that range.
+        CompletionCursor cursor(index, ranges);
+        uint32_t rank;
+        while (result.size() < limit && cursor.next(rank)) {
+            if (std::find(result.begin(), result.end(), rank) ==
+                result.end()) {
+                result.push_back(rank);
+            }
+        }
+    }
+    return result;
+}
+
+const std::vector<uint32_t> &
+CompletionContext::complete(const CompletionIndex &index,
+                            std::string_view prefix, size_t limit) {
+    if (index_ != &index) {
+        index_ = &index;
+        depth_ = 0;
+    }
+    while (depth_ > 0 && prefix.substr(0, stack_[depth_ - 1].prefix.size()) !=
+                             stack_[depth_ - 1].prefix) {
+        --depth_;
+    }
+    if (depth_ > 0 && stack_[depth_ - 1].prefix == prefix) {
+        if (stack_[depth_ - 1].limit >= limit) {
+            return stack_[depth_ - 1].ranks;
+        }
+        --depth_;
+    }
+
+    auto range = depth_ == 0 ? index.all() : stack_[depth_ - 1].range;
+    // Popped entries are reused, so that their buffers are too.
+    if (depth_ == stack_.size()) {
+        stack_.emplace_back();
+    }
+    auto &entry = stack_[depth_++];
+    entry.prefix = prefix;
+    entry.limit = limit;
+    entry.range = range.empty() ? range : index.narrow(range, prefix);
+    entry.ranks.clear();
+    CompletionCursor cursor(index, entry.range, prefix);
+    uint32_t rank;
+    while (entry.ranks.size() < limit && cursor.next(rank)) {
+        entry.ranks.push_back(rank);
+    }
+    return entry.ranks;
+}
+
+} // namespace fcitx::hallelujah
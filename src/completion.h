@@ -0,0 +1,211 @@
+#ifndef _FCITX5_HALLELUJAH_COMPLETION_H_
+#define _FCITX5_HALLELUJAH_COMPLETION_H_
+
+#include "dictformat.h"
+#include "wordstore.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <marisa/trie.h>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcitx::hallelujah {
+
+// Time by which a search should stop and return what it has found so far.
+// Searches check it cooperatively between steps. The clock is only read
+// every few checks, and once expired a deadline stays expired.
+class Deadline {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Never expires.
+    Deadline() = default;
+    explicit Deadline(Clock::time_point at) : at_(at), bounded_(true) {}
+
+    bool expired() {
+        if (bounded_ && !expired_ && checks_++ % CheckInterval == 0) {
+            expired_ = Clock::now() >= at_;
+        }
+        return expired_;
+    }
+    // Whether a check found the deadline passed, without checking again.
+    bool hasExpired() const { return expired_; }
+
+private:
+    static constexpr uint32_t CheckInterval = 16;
+
+    Clock::time_point at_;
+    bool bounded_ = false;
+    bool expired_ = false;
+    uint32_t checks_ = 0;
+};
+
+// Half-open range of lexicographic ranks sharing a common prefix.
+struct CompletionRange {
+    uint32_t begin = 0;
+    uint32_t end = 0;
+    bool empty() const { return begin >= end; }
+    uint32_t size() const { return empty() ? 0 : end - begin; }
+};
+
+// All keys of a trie sorted lexicographically, annotated with a max-frequency
+// segment tree so that the best completions of any prefix can be found
+// without enumerating the whole subtree. The system dictionaries come with
+// theirs built, so that it is mapped and shared by every process. Word
+// lists and data without one have it built in memory.
+class CompletionIndex {
+public:
+    using FrequencyFunc =
+        std::function<double(std::string_view key, uint32_t id)>;
+
+    // The content of an index file for the keys of trie.
+    static std::string serialize(const marisa::Trie &trie,
+                                 const FrequencyFunc &frequency);
+    // Throws std::runtime_error if the file is missing or malformed.
+    void load(const std::string &path);
+    void build(const marisa::Trie &trie, const FrequencyFunc &frequency);
+    void clear();
+
+    uint32_t size() const { return header_ ? header_->numKeys : 0; }
+    bool empty() const { return size() == 0; }
+    size_t mappedSize() const { return file_.size(); }
+    size_t heapSize() const { return image_.capacity(); }
+    CompletionRange all() const { return {0, size()}; }
+    // Narrows a range known to share a shorter prefix down to the keys that
+    // start with prefix.
+    CompletionRange narrow(CompletionRange range,
+                           std::string_view prefix) const;
+    CompletionRange range(std::string_view prefix) const {
+        return narrow(all(), prefix);
+    }
+    // Sets rank to the one of key, if key is in the index.
+    bool find(std::string_view key, uint32_t &rank) const;
+
+    std::string_view key(uint32_t rank) const {
+        return {keys_ + offsets_[rank], offsets_[rank + 1] - offsets_[rank]};
+    }
+    uint32_t id(uint32_t rank) const { return ids_[rank]; }
+    double frequency(uint32_t rank) const { return frequencies_[rank]; }
+    // Higher frequency first, ties broken in favor of the greater key.
+    bool better(uint32_t a, uint32_t b) const {
+        return frequencies_[a] != frequencies_[b]
+                   ? frequencies_[a] > frequencies_[b]
+                   : a > b;
+    }
+    // Rank with the highest (frequency, rank) in a non-empty range.
+    uint32_t best(CompletionRange range) const;
+    // Replaces letters with at most limit of the letters that follow the
+    // common prefix of the keys of range, whose length is depth. They are
+    // ordered by the best key continuing with each of them.
+    void nextLetters(CompletionRange range, size_t depth, size_t limit,
+                     std::string &letters) const;
+
+private:
+    // Points the accessors at data after checking all of it, since the
+    // lookups do not check their bounds.
+    void attach(const char *data, size_t size, const std::string &name);
+
+    MappedFile file_;
+    std::string image_;
+    const format::CompletionFileHeader *header_ = nullptr;
+    const double *frequencies_ = nullptr;
+    const uint32_t *ids_ = nullptr;
+    const uint32_t *tree_ = nullptr;
+    const uint32_t *offsets_ = nullptr;
+    const char *keys_ = nullptr;
+};
+
+// Yields the keys of a range best-first: an exact match of the prefix first,
+// then by descending frequency. Each step costs O(log n).
+class CompletionCursor {
+public:
+    CompletionCursor(const CompletionIndex &index, CompletionRange range,
+                     std::string_view prefix);
+    CompletionCursor(const CompletionIndex &index, std::string_view prefix)
+        : CompletionCursor(index, index.range(prefix), prefix) {}
+    // Best-first over the union of disjoint ranges, without exact match.
+    CompletionCursor(const CompletionIndex &index,
+                     const std::vector<CompletionRange> &ranges);
+
+    // Returns the next rank, or false when the range is exhausted.
+    bool next(uint32_t &rank);
+
+private:
+    struct Entry {
+        uint32_t best;
+        CompletionRange range;
+    };
+    struct Compare {
+        const CompletionIndex *index;
+        bool operator()(const Entry &a, const Entry &b) const;
+    };
+
+    void push(CompletionRange range);
+
+    const CompletionIndex &index_;
+    std::priority_queue<Entry, std::vector<Entry>, Compare> queue_;
+    int exact_ = -1;
+};
+
+// A rank in one of several stacked indexes.
+struct LayeredRank {
+    uint32_t layer = 0;
+    uint32_t rank = 0;
+};
+
+// Lazy k-way merge of the completions of prefix in several indexes: exact
+// matches first, then by descending frequency. The first index is given as
+// its best-first ranks, which must hold at least limit of them if there are
+// that many; the others are walked with cursors, one step per key taken. A
+// key found in more than one index is only yielded for its best entry.
+// Replaces result with at most limit entries.
+void mergeCompletions(const std::vector<const CompletionIndex *> &layers,
+                      const std::vector<uint32_t> &first,
+                      std::string_view prefix, size_t limit,
+                      std::vector<LayeredRank> &result);
+
+// Completions of the keys within maxDistance edits of query, where an edit
+// inserts, deletes or substitutes a letter or swaps two adjacent letters.
+// The sorted keys are walked as an implicit trie, so a subtree is skipped
+// as soon as every alignment of its prefix with query exceeds the budget.
+// Returns at most limit ranks, ordered by distance and then best-first.
+// If deadline expires, the walk stops and only what it has reached so far
+// is ranked.
+std::vector<uint32_t> fuzzyComplete(const CompletionIndex &index,
+                                    std::string_view query,
+                                    uint32_t maxDistance, size_t limit,
+                                    Deadline &deadline);
+
+// Remembers the range and best completions of every prefix typed during a
+// composition. Appending a letter narrows the previous range, deleting pops
+// back to the cached result of the shorter prefix, and an edit in the middle
+// only drops the prefixes past the edit.
+class CompletionContext {
+public:
+    // Returns at least the first limit completions of prefix, or all of them
+    // if there are fewer.
+    const std::vector<uint32_t> &complete(const CompletionIndex &index,
+                                          std::string_view prefix,
+                                          size_t limit);
+    void clear() { depth_ = 0; }
+
+private:
+    struct Entry {
+        std::string prefix;
+        size_t limit;
+        CompletionRange range;
+        std::vector<uint32_t> ranks;
+    };
+
+    const CompletionIndex *index_ = nullptr;
+    // Entries past depth_ are unused.
+    std::vector<Entry> stack_;
+    size_t depth_ = 0;
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
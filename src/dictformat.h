@@ -0,0 +1,97 @@
+#ifndef _FCITX5_HALLELUJAH_DICTFORMAT_H_
+#define _FCITX5_HALLELUJAH_DICTFORMAT_H_
+
+#include <cstdint>
+
+// On-disk layout of the binary dictionary files. Everything is stored in
+// host byte order and addressed by plain offsets, so that a file can be
+// mapped read-only and used in place.
+namespace fcitx::hallelujah::format {
+
+// words.bin, and cedict.bin with pinyin trie key IDs and English glosses as
+// translations:
+//   WordFileHeader
+//   double[numRecords]                frequency, indexed by trie key ID
+//   uint64_t[numBlocks + 1]           start of each block in the payloads
+//   char[dictionarySize]              zstd dictionary, if one was trained
+//   char[payloadsSize]                a zstd frame per block
+// Block i holds the payloads of records [i * blockRecords,
+// (i + 1) * blockRecords), where numBlocks is numRecords divided by
+// blockRecords rounded up. It decodes to, for each record in turn,
+//   uint32_t length, char[length]     IPA
+//   uint32_t count                    number of translations
+//   count times uint32_t length, char[length]
+// Only frequencies are read to rank, so the payloads of the few words on
+// display are all that is ever decoded.
+inline constexpr char WordMagic[4] = {'H', 'L', 'J', 'W'};
+inline constexpr uint32_t WordVersion = 2;
+
+struct WordFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numRecords;
+    uint32_t blockRecords;
+    uint64_t frequenciesOffset;
+    uint64_t blocksOffset;
+    uint64_t dictionaryOffset;
+    uint64_t dictionarySize;
+    uint64_t payloadsOffset;
+    uint64_t payloadsSize;
+};
+
+// bigram.bin, the next-word model over the word trie's key IDs:
+//   BigramFileHeader
+//   uint32_t[numKeys + 1]             start of the followers of each key
+//   BigramEntry[numEntries]           followers, most likely first
+inline constexpr char BigramMagic[4] = {'H', 'L', 'J', 'B'};
+inline constexpr uint32_t BigramVersion = 1;
+
+struct BigramFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numKeys;
+    uint32_t numEntries;
+    uint64_t offsetsOffset;
+    uint64_t entriesOffset;
+};
+
+struct BigramEntry {
+    uint32_t id : 24;
+    // log2 of the probability of the follower in eighths, offset so that
+    // 255 is a probability of 1.
+    uint32_t weight : 8;
+};
+
+// words.idx and cedict.idx, the completion index of the word and pinyin
+// tries. Ranks are the positions of the keys in lexicographic order:
+//   CompletionFileHeader
+//   double[numKeys]                   frequency, indexed by rank
+//   uint32_t[numKeys]                 trie key ID, indexed by rank
+//   uint32_t[2 * numKeys]             segment tree of the best rank: the
+//                                     leaves at [numKeys, 2 * numKeys),
+//                                     node i over nodes 2i and 2i + 1
+//   uint32_t[numKeys + 1]             start of each key in the keys
+//   char[keysSize]                    the keys, in lexicographic order
+inline constexpr char CompletionMagic[4] = {'H', 'L', 'J', 'C'};
+inline constexpr uint32_t CompletionVersion = 1;
+
+struct CompletionFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t numKeys;
+    uint32_t keysSize;
+    uint64_t frequenciesOffset;
+    uint64_t idsOffset;
+    uint64_t treeOffset;
+    uint64_t offsetsOffset;
+    uint64_t keysOffset;
+};
+
+static_assert(sizeof(WordFileHeader) == 64);
+static_assert(sizeof(CompletionFileHeader) == 56);
+static_assert(sizeof(BigramFileHeader) == 32);
+static_assert(sizeof(BigramEntry) == 4);
+
+} // namespace fcitx::hallelujah::format
+
+#endif
@@ -0,0 +1,403 @@
+#include "dictionary.h"
+#include "hallelujah.h"
+#ifdef HALLELUJAH_JSON
+#include "jsondict.h"
+#endif
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fcitx-utils/standardpaths.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+#include <system_error>
+
+namespace fcitx::hallelujah {
+
+namespace {
+
+// Relative to the directory of the language.
+constexpr const char *TrieFile = "google_227800_words.bin";
+constexpr const char *WordsFile = "words.bin";
+constexpr const char *PinyinTrieFile = "cedict.trie";
+constexpr const char *PinyinFile = "cedict.bin";
+constexpr const char *BigramFile = "bigram.bin";
+// Completion indexes of the two tries. Built in memory if not installed.
+constexpr const char *CompletionFile = "words.idx";
+constexpr const char *PinyinCompletionFile = "cedict.idx";
+// Read instead of words.bin and cedict.bin if those are not installed.
+constexpr const char *WordsJsonFile = "words.json";
+constexpr const char *PinyinJsonFile = "cedict.json";
+// The counts the trie was built from, which rank the words of words.json.
+constexpr const char *WordCountsFile = "google_227800_words.txt";
+// Word lists installed for every user of the machine.
+constexpr const char *SiteDirectory = "site";
+// Word lists of the user, next to the user history.
+constexpr const char *UserDirectory = "words";
+
+std::string fileFingerprint(const std::filesystem::path &path) {
+    std::error_code ec;
+    auto time = std::filesystem::last_write_time(path, ec);
+    auto size = std::filesystem::file_size(path, ec);
+    return fmt::format("{}:{}:{}\n", path.string(),
+                       time.time_since_epoch().count(), size);
+}
+
+} // namespace
+
+std::shared_ptr<const WordLayer>
+WordLayer::load(const std::filesystem::path &path) {
+    auto layer = std::make_shared<WordLayer>();
+    layer->fingerprint_ = fileFingerprint(path);
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open " + path.string());
+    }
+    marisa::Keyset keyset;
+    std::vector<double> frequencies;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos || line[begin] == '#') {
+            continue;
+        }
+        auto end = std::min(line.find_first_of(" \t", begin), line.size());
+        std::string word = line.substr(begin, end - begin);
+        std::transform(word.begin(), word.end(), word.begin(),
+                       [](unsigned char c) { return std::tolower(c); });
+        auto frequency = std::strtod(line.c_str() + end, nullptr);
+        if (!std::isfinite(frequency) || frequency <= 0) {
+            frequency = DefaultFrequency;
+        }
+        keyset.push_back(word.data(), word.size());
+        frequencies.push_back(frequency);
+    }
+    if (keyset.num_keys() == 0) {
+        return layer;
+    }
+    marisa::Trie trie;
+    trie.build(keyset);
+    // A word listed twice keeps its higher frequency.
+    std::vector<double> byId(trie.num_keys(), 0);
+    for (size_t i = 0; i < keyset.size(); ++i) {
+        auto &frequency = byId[keyset[i].id()];
+        frequency = std::max(frequency, frequencies[i]);
+    }
+    layer->completion_.build(
+        trie, [&byId](std::string_view, uint32_t id) { return byId[id]; });
+    return layer;
+}
+
+std::string HallelujahDictionary::directory(const std::string &language) {
+    if (language == DefaultLanguage) {
+        return "hallelujah";
+    }
+    // Also keeps the code from escaping the data directory.
+    if (language.empty() ||
+        !std::all_of(language.begin(), language.end(), [](unsigned char c) {
+            return std::isalnum(c) || c == '_' || c == '-';
+        })) {
+        throw std::runtime_error("Invalid language " + language);
+    }
+    return "hallelujah/" + language;
+}
+
+std::shared_ptr<const HallelujahDictionary>
+HallelujahDictionary::load(const std::string &language,
+                           const HallelujahDictionary *previous) {
+    auto dictionary = std::make_shared<HallelujahDictionary>();
+    dictionary->directory_ = directory(language);
+    // Taken first, so that a file replaced during the load is picked up by
+    // the next check rather than missed.
+    auto systemFingerprint = System::fingerprint(dictionary->directory_);
+    if (previous && previous->system_->loadedFrom == systemFingerprint) {
+        dictionary->system_ = previous->system_;
+    } else {
+        dictionary->system_ =
+            loadSystem(dictionary->directory_, systemFingerprint);
+    }
+    dictionary->fingerprint_ = systemFingerprint;
+    dictionary->layers_.push_back(&dictionary->system_->completion);
+    for (const auto &path : layerFiles(dictionary->directory_)) {
+        auto layerFingerprint = fileFingerprint(path);
+        dictionary->fingerprint_ += layerFingerprint;
+        std::shared_ptr<const WordLayer> layer;
+        if (previous) {
+            for (const auto &candidate : previous->wordLayers_) {
+                if (candidate->fingerprint() == layerFingerprint) {
+                    layer = candidate;
+                }
+            }
+        }
+        // A broken word list only loses its own words.
+        try {
+            if (!layer) {
+                layer = WordLayer::load(path);
+            }
+        } catch (const std::exception &e) {
+            HALLELUJAH_ERROR() << e.what();
+            continue;
+        }
+        if (layer->completion().empty()) {
+            continue;
+        }
+        dictionary->wordLayers_.push_back(layer);
+        dictionary->layers_.push_back(&layer->completion());
+    }
+    return dictionary;
+}
+
+std::shared_ptr<const HallelujahDictionary::System>
+HallelujahDictionary::loadSystem(const std::string &directory,
+                                 std::string loadedFrom) {
+    auto system = std::make_shared<System>();
+    system->directory = directory;
+    system->loadedFrom = std::move(loadedFrom);
+    // Each task fills a different member. The futures are declared after
+    // system, so they are joined before it goes away even if one of them
+    // throws.
+    auto trie =
+        std::async(std::launch::async, [&system]() { system->loadTrie(); });
+    auto words = std::async(std::launch::async, [&system]() {
+        system->loadWords();
+        system->loadBigram();
+    });
+    auto pinyin =
+        std::async(std::launch::async, [&system]() { system->loadPinyin(); });
+    trie.get();
+    words.get();
+    pinyin.get();
+    system->compileJson();
+    system->buildCompletion();
+    return system;
+}
+
+std::vector<std::filesystem::path>
+HallelujahDictionary::layerFiles(const std::string &directory) {
+    const auto &sp = fcitx::StandardPaths::global();
+    auto isWordList = [](const std::filesystem::path &path) {
+        return path.extension() == ".txt";
+    };
+    std::vector<std::filesystem::path> files;
+    // Sorted by name within each directory.
+    for (const auto &[name, path] :
+         sp.locate(fcitx::StandardPathsType::Data,
+                   directory + "/" + SiteDirectory, isWordList,
+                   fcitx::StandardPathsMode::System)) {
+        files.push_back(path);
+    }
+    for (const auto &[name, path] :
+         sp.locate(fcitx::StandardPathsType::PkgData,
+                   directory + "/" + UserDirectory, isWordList,
+                   fcitx::StandardPathsMode::User)) {
+        files.push_back(path);
+    }
+    return files;
+}
+
+std::string
+HallelujahDictionary::System::fingerprint(const std::string &directory) {
+    std::string result;
+    for (const auto *file :
+         {TrieFile, WordsFile, PinyinTrieFile, PinyinFile, BigramFile,
+          CompletionFile, PinyinCompletionFile, WordsJsonFile,
+          PinyinJsonFile, WordCountsFile}) {
+        result += fileFingerprint(locate(directory, file));
+    }
+    return result;
+}
+
+std::string
+HallelujahDictionary::System::locate(const std::string &directory,
+                                     const char *file) {
+    return fcitx::StandardPaths::global().locate(
+        fcitx::StandardPathsType::Data, directory + "/" + file);
+}
+
+std::string
+HallelujahDictionary::filesFingerprint(const std::string &directory) {
+    auto result = System::fingerprint(directory);
+    for (const auto &path : layerFiles(directory)) {
+        result += fileFingerprint(path);
+    }
+    return result;
+}
+
+std::string HallelujahDictionary::fingerprint(const std::string &language) {
+    try {
+        return filesFingerprint(directory(language));
+    } catch (const std::runtime_error &) {
+        return {};
+    }
+}
+
+bool HallelujahDictionary::contains(std::string_view word) const {
+    uint32_t rank;
+    return std::any_of(layers_.begin(), layers_.end(),
+                       [word, &rank](const CompletionIndex *layer) {
+                           return layer->find(word, rank);
+                       });
+}
+
+bool HallelujahDictionary::outdated() const {
+    return filesFingerprint(directory_) != fingerprint_;
+}
+
+std::string HallelujahDictionary::memoryJson() const {
+    size_t layers = 0;
+    for (const auto &layer : wordLayers_) {
+        layers += layer->completion().heapSize();
+    }
+    const auto &completion = system_->completion;
+    const auto &pinyinCompletion = system_->pinyinCompletion;
+    return fmt::format(
+        R"({{"trie":{},"words_mapped":{},"completion_mapped":{},)"
+        R"("pinyin_mapped":{},"pinyin_completion_mapped":{},)"
+        R"("bigram_mapped":{},"words_heap":{},"completion_heap":{},)"
+        R"("word_lists":{}}})",
+        system_->trie.io_size(), system_->words.mappedSize(),
+        completion.mappedSize(), system_->pinyin.mappedSize(),
+        pinyinCompletion.mappedSize(), system_->bigram.mappedSize(),
+        system_->words.heapSize() + system_->pinyin.heapSize(),
+        completion.heapSize() + pinyinCompletion.heapSize(), layers);
+}
+
+void HallelujahDictionary::System::loadTrie() {
+    auto trie_path = locate(directory, TrieFile);
+    if (trie_path.empty()) {
+        throw std::runtime_error("Failed to locate google_227800_words.bin");
+    }
+    // Map instead of reading so that every process shares the same pages.
+    try {
+        trie.mmap(trie_path.c_str());
+    } catch (const marisa::Exception &) {
+        throw std::runtime_error("Failed to open google_227800_words.bin");
+    }
+}
+
+void HallelujahDictionary::System::buildCompletion() {
+    if (words.size() != trie.num_keys()) {
+        throw std::runtime_error(
+            "words.bin does not match google_227800_words.bin");
+    }
+    if (!bigram.empty() && bigram.numKeys() != trie.num_keys()) {
+        throw std::runtime_error(
+            "bigram.bin does not match google_227800_words.bin");
+    }
+    auto path = locate(directory, CompletionFile);
+    // Frequencies compiled from words.json alone need not match the index.
+    if (path.empty() || (!wordsJson.empty() && wordCounts.empty())) {
+        completion.build(trie, [this](std::string_view, uint32_t id) {
+            return words.frequency(id);
+        });
+        return;
+    }
+    completion.load(path);
+    if (completion.size() != trie.num_keys()) {
+        throw std::runtime_error(
+            "words.idx does not match google_227800_words.bin");
+    }
+}
+
+void HallelujahDictionary::System::loadWords() {
+    auto words_path = locate(directory, WordsFile);
+    if (words_path.empty()) {
+#ifdef HALLELUJAH_JSON
+        wordsJson = locate(directory, WordsJsonFile);
+        if (!wordsJson.empty()) {
+            wordCounts = locate(directory, WordCountsFile);
+            return;
+        }
+#endif
+        throw std::runtime_error("Failed to locate words.bin");
+    }
+    words.load(words_path);
+}
+
+void HallelujahDictionary::System::loadBigram() {
+    // The model is optional, since it needs a corpus to be built.
+    auto path = locate(directory, BigramFile);
+    if (!path.empty()) {
+        bigram.load(path);
+    }
+}
+
+void HallelujahDictionary::System::compileJson() {
+#ifdef HALLELUJAH_JSON
+    auto log = [](const std::string &path, const JsonStats &stats) {
+        HALLELUJAH_DEBUG() << "Parsed " << stats.entries << " entries of "
+                           << path << " in " << stats.seconds
+                           << " s, peak RSS " << stats.peakRssKb << " KiB";
+    };
+    // Kept in memory for this run only, so compressed at the fastest level
+    // and without training a dictionary.
+    constexpr int level = 1;
+    if (!wordsJson.empty()) {
+        JsonStats stats;
+        auto builder = compileWordsJson(trie, wordsJson, stats);
+        log(wordsJson, stats);
+        // Ranked as by words.bin, which hallelujah-dict build takes the
+        // frequencies of from the word list rather than from words.json.
+        if (!wordCounts.empty()) {
+            JsonStats countStats;
+            applyWordCounts(trie, wordCounts, builder, countStats);
+            log(wordCounts, countStats);
+        } else {
+            HALLELUJAH_WARN() << WordCountsFile << " not found, ranking by "
+                              << "the frequencies of " << wordsJson;
+        }
+        words.assign(builder.serialize(level, 0));
+    }
+    // Weighted by the words, so it comes second.
+    if (!pinyinJson.empty()) {
+        JsonStats stats;
+        marisa::Trie pinyinTrie;
+        pinyin.assign(
+            compilePinyinJson(trie, words, pinyinJson, pinyinTrie, stats)
+                .serialize(level, 0));
+        log(pinyinJson, stats);
+        pinyinCompletion.build(pinyinTrie, [this](std::string_view,
+                                                  uint32_t id) {
+            return pinyin.frequency(id);
+        });
+    }
+#endif
+}
+
+void HallelujahDictionary::System::loadPinyin() {
+    auto trie_path = locate(directory, PinyinTrieFile);
+    auto pinyin_path = locate(directory, PinyinFile);
+    // Optional, since a language need not come with glosses of pinyin.
+    if (trie_path.empty() || pinyin_path.empty()) {
+#ifdef HALLELUJAH_JSON
+        pinyinJson = locate(directory, PinyinJsonFile);
+#endif
+        return;
+    }
+    marisa::Trie pinyinTrie;
+    try {
+        pinyinTrie.mmap(trie_path.c_str());
+    } catch (const marisa::Exception &) {
+        throw std::runtime_error("Failed to open cedict.trie");
+    }
+    pinyin.load(pinyin_path);
+    if (pinyin.size() != pinyinTrie.num_keys()) {
+        throw std::runtime_error("cedict.bin does not match cedict.trie");
+    }
+    auto index_path = locate(directory, PinyinCompletionFile);
+    if (index_path.empty()) {
+        pinyinCompletion.build(pinyinTrie,
+                               [this](std::string_view, uint32_t id) {
+                                   return pinyin.frequency(id);
+                               });
+        return;
+    }
+    pinyinCompletion.load(index_path);
+    if (pinyinCompletion.size() != pinyinTrie.num_keys()) {
+        throw std::runtime_error("cedict.idx does not match cedict.trie");
+    }
+}
+} // namespace fcitx::hallelujah
@@ -0,0 +1,130 @@
+#ifndef _FCITX5_HALLELUJAH_DICTIONARY_H_
+#define _FCITX5_HALLELUJAH_DICTIONARY_H_
+
+#include "bigram.h"
+#include "completion.h"
+#include "wordstore.h"
+#include <filesystem>
+#include <marisa/trie.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcitx::hallelujah {
+
+// A plain text word list stacked on top of the system dictionary, such as a
+// team's jargon. Each line holds a word and optionally its frequency. Lists
+// are small, so they are built in memory when loaded.
+class WordLayer {
+public:
+    // Frequency of a word listed without one, about that of a common
+    // English word.
+    static constexpr double DefaultFrequency = 1e6;
+
+    // Throws std::runtime_error if the file cannot be read.
+    static std::shared_ptr<const WordLayer>
+    load(const std::filesystem::path &path);
+
+    const CompletionIndex &completion() const { return completion_; }
+    const std::string &fingerprint() const { return fingerprint_; }
+
+private:
+    CompletionIndex completion_;
+    std::string fingerprint_;
+};
+
+// Everything the keystroke path reads. A dictionary is never modified after
+// load() returns, so it can be shared by all input contexts and outlive the
+// engine's reference to it.
+class HallelujahDictionary {
+public:
+    // Its files are directly in hallelujah/, those of any other language
+    // in hallelujah/<language>/.
+    static constexpr const char *DefaultLanguage = "en";
+
+    // Loads the word and pinyin dictionaries of language in parallel, then
+    // the word lists of the site and of the user. Parts whose files are
+    // unchanged since previous was loaded are shared with it instead, so
+    // editing a user word list does not load the system dictionary again.
+    // Throws std::runtime_error on failure. Safe to call from any thread.
+    static std::shared_ptr<const HallelujahDictionary>
+    load(const std::string &language,
+         const HallelujahDictionary *previous = nullptr);
+
+    const marisa::Trie &trie() const { return system_->trie; }
+    const WordStore &words() const { return system_->words; }
+    const CompletionIndex &completion() const { return system_->completion; }
+    // Empty if no cedict.bin is installed for the language.
+    const WordStore &pinyin() const { return system_->pinyin; }
+    const CompletionIndex &pinyinCompletion() const {
+        return system_->pinyinCompletion;
+    }
+    // Empty if no bigram.bin is installed.
+    const BigramModel &bigram() const { return system_->bigram; }
+    // The system word index, then those of the site and user word lists.
+    const std::vector<const CompletionIndex *> &layers() const {
+        return layers_;
+    }
+    // Whether word is in any layer.
+    bool contains(std::string_view word) const;
+    // Whether the files this was loaded from have been replaced since.
+    // Only stats the files, so it is cheap enough for the main thread.
+    bool outdated() const;
+    // Path, modification time and size of every file a load of language
+    // reads, so that a failed load need only be tried again once they
+    // change. Empty if language is not a plain code.
+    static std::string fingerprint(const std::string &language);
+    // Size in bytes of each part, as a JSON object.
+    std::string memoryJson() const;
+
+private:
+    struct System {
+        // Path, modification time and size of every file load() reads.
+        static std::string fingerprint(const std::string &directory);
+        // Empty if the file is not installed.
+        static std::string locate(const std::string &directory,
+                                  const char *file);
+
+        void loadTrie();
+        void loadWords();
+        void loadPinyin();
+        void loadBigram();
+        // Builds words and pinyin from the JSON files found in place of
+        // the compiled ones, once the trie is loaded.
+        void compileJson();
+        void buildCompletion();
+
+        marisa::Trie trie;
+        WordStore words;
+        CompletionIndex completion;
+        WordStore pinyin;
+        CompletionIndex pinyinCompletion;
+        BigramModel bigram;
+        // Relative to the data directories.
+        std::string directory;
+        std::string loadedFrom;
+        std::string wordsJson;
+        std::string pinyinJson;
+        std::string wordCounts;
+    };
+
+    // Throws std::runtime_error if language is not a plain code.
+    static std::string directory(const std::string &language);
+    static std::shared_ptr<const System>
+    loadSystem(const std::string &directory, std::string loadedFrom);
+    // Word lists of the site, then of the user.
+    static std::vector<std::filesystem::path>
+    layerFiles(const std::string &directory);
+    static std::string filesFingerprint(const std::string &directory);
+
+    std::string directory_;
+    std::shared_ptr<const System> system_;
+    std::vector<std::shared_ptr<const WordLayer>> wordLayers_;
+    std::vector<const CompletionIndex *> layers_;
+    std::string fingerprint_;
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
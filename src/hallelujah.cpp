@@ -1,25 +1,41 @@
 #include "hallelujah.h"
 #include <algorithm>
 #include <cctype>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/standardpaths.h>
 #include <fcitx/candidatelist.h>
 #include <fcitx/inputpanel.h>
 #include <fmt/format.h>
-#include <fmt/ranges.h>
-#include <fstream>
-#include <marisa/iostream.h>
-#include <nlohmann/json.hpp>
+#include <optional>
 #include <spell_public.h>
 
-using json = nlohmann::json;
-
 namespace fcitx::hallelujah {
+FCITX_DEFINE_LOG_CATEGORY(hallelujah, "hallelujah");
+
 static const std::array<Key, 10> selectionKeys = {
     Key{FcitxKey_1}, Key{FcitxKey_2}, Key{FcitxKey_3}, Key{FcitxKey_4},
     Key{FcitxKey_5}, Key{FcitxKey_6}, Key{FcitxKey_7}, Key{FcitxKey_8},
     Key{FcitxKey_9}, Key{FcitxKey_0},
 };
 
+static const std::array<const char *, 10> labelTexts = {
+    "1 ", "2 ", "3 ", "4 ", "5 ", "6 ", "7 ", "8 ", "9 ", "0 ",
+};
+
+// Keys that act on a candidate list rather than on the buffer.
+static bool isCandidateKey(const Key &key) {
+    return key.keyListIndex(selectionKeys) >= 0 ||
+           key.check(FcitxKey_space) || key.check(FcitxKey_Return) ||
+           key.check(FcitxKey_Page_Down) || key.check(FcitxKey_Page_Up) ||
+           key.check(FcitxKey_Down) || key.check(FcitxKey_Up) ||
+           key.check(FcitxKey_Escape);
+}
+
+static bool isCursorKey(const Key &key) {
+    return key.check(FcitxKey_Left) || key.check(FcitxKey_Right) ||
+           key.check(FcitxKey_Home) || key.check(FcitxKey_End);
+}
+
 std::string lower(const std::string &s) {
     std::string r = s;
     std::transform(r.begin(), r.end(), r.begin(),
@@ -29,43 +45,72 @@ std::string lower(const std::string &s) {
 
 class HallelujahCandidateWord : public CandidateWord {
 public:
-    HallelujahCandidateWord(HallelujahState *state, const std::string &word,
+    HallelujahCandidateWord(HallelujahState *state, std::string word,
                             const std::string &comment)
         : state_(state) {
-        setText(Text(word));
+        setText(Text(std::move(word)));
         if (!comment.empty()) {
             setComment(Text(comment));
         }
     }
 
     void select(InputContext *inputContext) const override {
-        auto config = state_->engine()->config();
-        auto word = text().toString();
-        if (*config.commitWithSpace) {
-            word += " ";
-        }
-        inputContext->commitString(word);
-        state_->reset(inputContext);
+        const auto &config = state_->engine()->config();
+        state_->commit(inputContext, text().toString(),
+                       *config.commitWithSpace);
     }
 
 private:
     HallelujahState *state_;
 };
 
+// Pages are materialized one at a time: later results are only searched
+// for when the user pages past what is known, and comments are only looked
+// up for the page on display.
 class HallelujahCandidateList : public CandidateList,
+                                public PageableCandidateList,
                                 public CursorMovableCandidateList {
 public:
+    HallelujahCandidateList(HallelujahState *state, std::string userInput,
+                            bool complete)
+        : state_(state), userInput_(std::move(userInput)),
+          normalized_(lower(userInput_)) {
+        // One more than a page tells whether there is a next page.
+        words_ = state_->candidates(normalized_, PageSize + 1, complete);
+        exhausted_ = words_.size() < PageSize + 1;
+        setPageable(this);
+        setCursorMovable(this);
+        loadPage(0);
+    }
+
+    // A fixed list, such as the predictions after a commit.
     HallelujahCandidateList(HallelujahState *state,
-                            const std::vector<std::string> &words,
-                            const std::vector<std::string> &comments) {
+                            std::vector<std::string> words)
+        : state_(state), words_(std::move(words)), exhausted_(true) {
+        setPageable(this);
         setCursorMovable(this);
-        for (size_t i = 0; i < words.size(); ++i) {
-            labels_.emplace_back(std::to_string((i + 1) % 10) + " ");
-            candidateWords_.emplace_back(
-                std::make_unique<HallelujahCandidateWord>(state, words[i],
-                                                          comments[i]));
+        loadPage(0);
+        // Nothing is highlighted until the list is selected into.
+        cursor_ = -1;
+    }
+
+    bool hasPrev() const override { return page_ > 0; }
+    bool hasNext() const override {
+        return fetch((page_ + 1) * PageSize + 1);
+    }
+    void prev() override {
+        if (hasPrev()) {
+            loadPage(page_ - 1);
         }
     }
+    void next() override {
+        if (hasNext()) {
+            loadPage(page_ + 1);
+            usedNextBefore_ = true;
+        }
+    }
+    bool usedNextBefore() const override { return usedNextBefore_; }
+    int currentPage() const override { return page_; }
 
     void prevCandidate() override { cursor_ = (cursor_ + size() - 1) % size(); }
 
@@ -94,8 +139,49 @@ private:
         }
     }
 
+    // Makes sure the first count results are known if there are that many.
+    bool fetch(size_t count) const {
+        if (words_.size() < count && !exhausted_) {
+            auto limit = std::max(count, words_.size() + PageSize);
+            words_ = state_->candidates(normalized_, limit, true);
+            exhausted_ = words_.size() < limit;
+        }
+        return words_.size() >= count;
+    }
+
+    void loadPage(int page) {
+        auto begin = page * PageSize;
+        fetch(begin + PageSize);
+        auto end = std::min(words_.size(), begin + PageSize);
+        StageTimer timer(state_->engine()->latency(), Stage::Comment);
+        labels_.clear();
+        candidateWords_.clear();
+        labels_.reserve(end - begin);
+        candidateWords_.reserve(end - begin);
+        for (auto i = begin; i < end; ++i) {
+            const auto &comment = state_->comment(words_[i]);
+            auto word = words_[i];
+            if (word.compare(0, normalized_.size(), normalized_) == 0) {
+                std::copy(userInput_.begin(), userInput_.end(), word.begin());
+            }
+            labels_.emplace_back(labelTexts[i - begin]);
+            candidateWords_.emplace_back(
+                std::make_unique<HallelujahCandidateWord>(
+                    state_, std::move(word), comment));
+        }
+        page_ = page;
+        cursor_ = 0;
+    }
+
+    HallelujahState *state_;
+    std::string userInput_;
+    std::string normalized_;
+    mutable std::vector<std::string> words_;
+    mutable bool exhausted_ = false;
     std::vector<Text> labels_;
     std::vector<std::unique_ptr<CandidateWord>> candidateWords_;
+    int page_ = 0;
+    bool usedNextBefore_ = false;
     int cursor_ = 0;
 };
 
@@ -126,26 +212,97 @@ void HallelujahState::updatePreedit(InputContext *ic) {
 }
 
 void HallelujahState::updateUI(InputContext *ic,
-                               const std::vector<std::string> &words,
-                               const std::vector<std::string> &comments) {
-    auto &inputPanel = ic->inputPanel();
-    if (words.empty()) {
-        inputPanel.setCandidateList(nullptr);
-    } else {
-        inputPanel.setCandidateList(
-            std::make_unique<HallelujahCandidateList>(this, words, comments));
-    }
+                               std::unique_ptr<CandidateList> candidateList) {
+    ic->inputPanel().setCandidateList(std::move(candidateList));
     updatePreedit(ic);
 }
 
 void HallelujahState::reset(InputContext *ic) {
+    cancelUpdates();
+    selectingPrediction_ = false;
     buffer_.clear();
-    updateUI(ic, {}, {});
+    context_.clear();
+    dictionary_.reset();
+    ic->inputPanel().setAuxUp(Text());
+    updateUI(ic, nullptr);
+}
+
+void HallelujahState::commit(InputContext *ic, std::string word,
+                             bool withSpace) {
+    engine_->learn(dictionary_.get(), word);
+    std::string text;
+    // A prediction follows the word committed before it, which is not
+    // always followed by a space.
+    if (selectingPrediction_ && !lastCommitSpaced_) {
+        text = " ";
+    }
+    text += word;
+    if (withSpace) {
+        text += " ";
+    }
+    ic->commitString(text);
+    lastCommitSpaced_ = withSpace;
+    reset(ic);
+    predict(ic, word);
+}
+
+void HallelujahState::predict(InputContext *ic, const std::string &word) {
+    auto dictionary = engine_->dictionary(language_);
+    if (!*engine_->config().prediction || !dictionary ||
+        dictionary->bigram().empty()) {
+        return;
+    }
+    auto normalized = lower(word);
+    const auto &trie = dictionary->trie();
+    agent_.set_query(normalized.data(), normalized.size());
+    if (!trie.lookup(agent_)) {
+        return;
+    }
+    dictionary->bigram().predict(agent_.key().id(), PageSize, predicted_);
+    if (predicted_.empty()) {
+        return;
+    }
+    std::vector<std::string> words;
+    words.reserve(predicted_.size());
+    for (auto id : predicted_) {
+        agent_.set_query(id);
+        trie.reverse_lookup(agent_);
+        words.emplace_back(agent_.key().ptr(), agent_.key().length());
+    }
+    // Kept for the comments until the predictions are dismissed.
+    dictionary_ = std::move(dictionary);
+    updateUI(ic, std::make_unique<HallelujahCandidateList>(this,
+                                                           std::move(words)));
 }
 
 void HallelujahState::keyEvent(KeyEvent &event) {
+    keyTime_ = Deadline::Clock::now();
     auto key = event.key();
+    // Keys that act on the candidates must see the complete results for
+    // the buffer, which may still be queued. Editing keys queue another
+    // search instead, and any other key commits the buffer as typed.
+    if (updatePending() && (isCandidateKey(key) || isCursorKey(key))) {
+        updateCandidates(true);
+    }
     auto candidateList = ic_->inputPanel().candidateList();
+    if (buffer_.empty() && candidateList && candidateList->size()) {
+        // Predictions leave every key to the application, the number keys
+        // included, until Tab selects into them. From then on they take
+        // the same keys as any other candidates.
+        if (!selectingPrediction_ && key.check(FcitxKey_Tab)) {
+            selectingPrediction_ = true;
+            candidateList->toCursorMovable()->nextCandidate();
+            ic_->updateUserInterface(UserInterfaceComponent::InputPanel);
+            return event.filterAndAccept();
+        }
+        if (!selectingPrediction_ || !isCandidateKey(key)) {
+            reset(ic_);
+            if (key.check(FcitxKey_Escape)) {
+                return event.filterAndAccept();
+            }
+            candidateList = nullptr;
+        }
+    }
     if (candidateList && candidateList->size()) {
         int idx = key.keyListIndex(selectionKeys);
         if (idx >= 0 && idx < candidateList->size()) {
@@ -154,15 +311,22 @@ void HallelujahState::keyEvent(KeyEvent &event) {
         }
         if (key.check(FcitxKey_space) || key.check(FcitxKey_Return)) {
             event.filterAndAccept();
-            std::string word =
+            return commit(
+                ic_,
                 candidateList->candidate(candidateList->cursorIndex())
                     .text()
-                    .toString();
-            if (key.check(FcitxKey_space)) {
-                word += " ";
+                    .toString(),
+                key.check(FcitxKey_space));
+        }
+        if (key.check(FcitxKey_Page_Down) || key.check(FcitxKey_Page_Up)) {
+            auto pageable = candidateList->toPageable();
+            if (key.check(FcitxKey_Page_Down)) {
+                pageable->next();
+            } else {
+                pageable->prev();
             }
-            ic_->commitString(word);
-            return reset(ic_);
+            ic_->updateUserInterface(UserInterfaceComponent::InputPanel);
+            return event.filterAndAccept();
         }
         if (key.check(FcitxKey_Down) || key.check(FcitxKey_Up)) {
             auto cm = candidateList->toCursorMovable();
@@ -174,8 +338,7 @@ void HallelujahState::keyEvent(KeyEvent &event) {
             ic_->updateUserInterface(UserInterfaceComponent::InputPanel);
             return event.filterAndAccept();
         }
-        if (key.check(FcitxKey_Left) || key.check(FcitxKey_Right) ||
-            key.check(FcitxKey_Home) || key.check(FcitxKey_End)) {
+        if (isCursorKey(key)) {
             auto size = buffer_.size();
             auto cursor = buffer_.cursor();
             if (key.check(FcitxKey_Home)) {
@@ -203,187 +366,699 @@ void HallelujahState::keyEvent(KeyEvent &event) {
     } else if (key.isLAZ() || key.isUAZ()) {
         buffer_.type(key.sym());
     } else {
-        ic_->commitString(buffer_.userInput());
+        if (!buffer_.empty()) {
+            ic_->commitString(buffer_.userInput());
+        }
         return reset(ic_);
     }
-    std::vector<std::string> words;
-    std::vector<std::string> comments;
+    event.filterAndAccept();
+    updatePreedit(ic_);
+    if (buffer_.empty()) {
+        // Nothing to search for, and a list left showing would be taken
+        // for predictions.
+        updateCandidates(false);
+    } else {
+        scheduleSearch();
+    }
+}
+
+void HallelujahState::updateCandidates(bool complete) {
+    auto &latency = engine_->latency();
+    StageTimer totalTimer(latency, Stage::Total);
+    cancelUpdates();
+    if (!dictionary_) {
+        dictionary_ = engine_->dictionary(language_);
+    }
+    std::unique_ptr<CandidateList> candidateList;
     if (!buffer_.empty()) {
-        marisa::Agent agent;
-        auto userInput = buffer_.userInput();
-        auto normalized = lower(userInput);
-        agent.set_query(normalized.c_str());
-        while (trie_->predictive_search(agent)) {
-            words.emplace_back(agent.key().ptr(), agent.key().length());
-        }
-        auto n = std::min<size_t>(words.size(), 10);
-        if (n) {
-            std::partial_sort(
-                words.begin(), words.begin() + n, words.end(),
-                [this, &normalized](const std::string &a,
-                                    const std::string &b) {
-                    auto na = a == normalized ? 1 : 0;
-                    auto nb = b == normalized ? 1 : 0;
-                    auto ia = words_->find(a);
-                    auto fa = ia == words_->end() ? 0 : ia->second.frequency_;
-                    auto ib = words_->find(b);
-                    auto fb = ib == words_->end() ? 0 : ib->second.frequency_;
-                    return std::tie(na, fa, a) > std::tie(nb, fb, b);
-                });
-            words.resize(n);
-        } else {
-            auto iter = pinyin_->find(normalized);
-            if (iter != pinyin_->end()) {
-                words = iter->second;
-            } else {
-                words =
-                    engine_->spell()->call<ISpell::hint>("en", normalized, 9);
+        candidateList = std::make_unique<HallelujahCandidateList>(
+            this, buffer_.userInput(), complete);
+    }
+    // Input is passed through as is until the dictionary is ready, or
+    // until its files are fixed if it failed to load.
+    Text aux;
+    if (!dictionary_ && !buffer_.empty()) {
+        aux = Text(engine_->loadFailed(language_)
+                       ? _("Dictionary not available")
+                       : _("Loading dictionary..."));
+    }
+    ic_->inputPanel().setAuxUp(std::move(aux));
+    // The preedit was updated along with the buffer.
+    {
+        StageTimer timer(latency, Stage::UI);
+        ic_->inputPanel().setCandidateList(std::move(candidateList));
+        ic_->updateUserInterface(UserInterfaceComponent::InputPanel);
+    }
+    // A refinement still to come speculates once it is done.
+    if (!buffer_.empty() && !updatePending()) {
+        scheduleSpeculation();
+    }
+}
+
+std::vector<std::string>
+HallelujahState::candidates(const std::string &normalized, size_t limit,
+                            bool complete) {
+    std::vector<std::string> words;
+    words.reserve(limit + 1);
+    auto budget = *engine_->config().latencyBudget;
+    Deadline deadline = complete || budget <= 0
+                            ? Deadline()
+                            : Deadline(keyTime_ + std::chrono::milliseconds(
+                                                      budget));
+    if (dictionary_) {
+        search(normalized, words, limit, complete, deadline);
+    }
+    if (deadline.hasExpired()) {
+        engine_->budgetExceeded();
+        scheduleRefine();
+    }
+    // The typed text itself always comes first.
+    if (words.empty() || words[0] != normalized) {
+        words.emplace(words.begin(), normalized);
+    }
+    words.resize(std::min(words.size(), limit));
+    return words;
+}
+
+void HallelujahState::search(const std::string &normalized,
+                             std::vector<std::string> &words, size_t limit,
+                             bool complete, Deadline &deadline) {
+    auto &latency = engine_->latency();
+    const auto &completion = dictionary_->completion();
+    PrefixResult computed;
+    const auto *result =
+        engine_->cachedPrefix(dictionary_.get(), normalized, limit);
+    if (!result) {
+        computed = rankPrefix(normalized, limit, deadline);
+        // Results cut short are refined later rather than shared.
+        if (!deadline.hasExpired()) {
+            engine_->cachePrefix(dictionary_.get(), normalized, computed);
+        }
+        result = &computed;
+    }
+    for (size_t i = 0; i < result->completions.size() && i < limit; ++i) {
+        words.emplace_back(key(result->completions[i]));
+    }
+    if (words.empty() && !dictionary_->pinyinCompletion().empty()) {
+        // Glosses of the exact pinyin first, then of its completions.
+        StageTimer timer(latency, Stage::Pinyin);
+        const auto &pinyinCompletion = dictionary_->pinyinCompletion();
+        const auto &pinyin = dictionary_->pinyin();
+        CompletionCursor cursor(pinyinCompletion, normalized);
+        uint32_t rank;
+        while (words.size() < limit && !deadline.expired() &&
+               cursor.next(rank)) {
+            auto id = pinyinCompletion.id(rank);
+            for (uint32_t i = 0, n = pinyin.translationCount(id);
+                 i < n && words.size() < limit; ++i) {
+                auto gloss = pinyin.translation(id, i);
+                if (std::find(words.begin(), words.end(), gloss) ==
+                    words.end()) {
+                    words.emplace_back(gloss);
+                }
             }
         }
-        if (words.empty() || words[0] != normalized) {
-            words.emplace(words.begin(), normalized);
+    }
+    // Corrections of typos, after anything that matches as typed.
+    for (auto rank : result->corrections) {
+        if (words.size() >= limit) {
+            break;
+        }
+        auto word = completion.key(rank);
+        if (std::find(words.begin(), words.end(), word) == words.end()) {
+            words.emplace_back(word);
+        }
+    }
+    if (!words.empty()) {
+        return;
+    }
+    // The spell backend can be slow, so unless the suggestions are cached
+    // they are fetched once the event loop is idle and the candidates are
+    // refreshed then. Further typing cancels the request.
+    if (const auto *hint = engine_->cachedSpellHint(language_, normalized)) {
+        words = *hint;
+    } else if (complete) {
+        StageTimer timer(latency, Stage::Spell);
+        words = engine_->spellHint(language_, normalized);
+    } else {
+        scheduleRefine();
+    }
+}
+
+void HallelujahState::rerank(const std::string &normalized,
+                             std::vector<LayeredRank> &ranks) {
+    // Every word outside the static top ranks that was never committed
+    // scores at most as high as the ones inside, so merging in the
+    // committed words is enough to get the top ranks by blended score.
+    // That is a lookup per committed word with the prefix, so short
+    // prefixes cost more as the history grows.
+    const auto &history = engine_->history();
+    const auto &layers = dictionary_->layers();
+    history.complete(normalized, historyWords_);
+    for (auto word : historyWords_) {
+        if (std::any_of(ranks.begin(), ranks.end(),
+                        [this, word](LayeredRank item) {
+                            return key(item) == word;
+                        })) {
+            continue;
         }
-        words.resize(std::min<size_t>(words.size(), 10));
-        for (auto &word : words) {
-            auto iter = words_->find(word);
-            if (word.rfind(normalized, 0) != std::string::npos) {
-                std::copy(userInput.begin(), userInput.end(), word.begin());
+        // The most frequent entry, as the merge would have picked.
+        std::optional<LayeredRank> found;
+        uint32_t rank;
+        for (uint32_t layer = 0; layer < layers.size(); ++layer) {
+            if (layers[layer]->find(word, rank) &&
+                (!found || layers[layer]->frequency(rank) >
+                               layers[found->layer]->frequency(found->rank))) {
+                found = LayeredRank{layer, rank};
             }
-            if (iter != words_->end()) {
-                auto config = engine_->config();
-                std::string comment = *config.showIPA ? iter->second.ipa_ : "";
-                if (!comment.empty()) {
-                    comment = fmt::format("[{}] ", comment);
-                }
-                if (*config.showTranslation) {
-                    comment += fmt::format(
-                        "{}", fmt::join(iter->second.translation_, " "));
-                }
-                comments.emplace_back(std::move(comment));
-            } else {
-                comments.emplace_back("");
+        }
+        if (found) {
+            ranks.push_back(*found);
+        }
+    }
+    // The exact match stays first.
+    auto begin = ranks.begin();
+    if (begin != ranks.end() && key(*begin) == normalized) {
+        ++begin;
+    }
+    auto &scored = scored_;
+    scored.clear();
+    for (auto iter = begin; iter != ranks.end(); ++iter) {
+        scored.emplace_back(layers[iter->layer]->frequency(iter->rank) *
+                                history.boost(key(*iter)),
+                            *iter);
+    }
+    std::sort(scored.begin(), scored.end(),
+              [&layers](const auto &a, const auto &b) {
+                  if (a.first != b.first) {
+                      return a.first > b.first;
+                  }
+                  if (a.second.layer != b.second.layer) {
+                      return a.second.layer < b.second.layer;
+                  }
+                  return layers[a.second.layer]->better(a.second.rank,
+                                                        b.second.rank);
+              });
+    std::transform(scored.begin(), scored.end(), begin,
+                   [](const auto &item) { return item.second; });
+}
+
+PrefixResult HallelujahState::rankPrefix(const std::string &normalized,
+                                         size_t limit, Deadline &deadline) {
+    auto &latency = engine_->latency();
+    const auto &completion = dictionary_->completion();
+    PrefixResult result;
+    result.limit = limit;
+    {
+        StageTimer timer(latency, Stage::Completion);
+        const auto &best = context_.complete(completion, normalized, limit);
+        mergeCompletions(dictionary_->layers(), best, normalized, limit,
+                         result.completions);
+        if (*engine_->config().userHistory) {
+            rerank(normalized, result.completions);
+        }
+    }
+    // A single edit is allowed from four letters on. Two are only tried
+    // for long words that are not within one edit of anything, since the
+    // search space grows quickly with the budget.
+    if (result.completions.size() < limit && normalized.size() >= 4 &&
+        !deadline.expired()) {
+        StageTimer timer(latency, Stage::Fuzzy);
+        result.corrections =
+            fuzzyComplete(completion, normalized, 1, limit, deadline);
+        if (result.corrections.empty() && normalized.size() >= 8 &&
+            !deadline.hasExpired()) {
+            result.corrections =
+                fuzzyComplete(completion, normalized, 2, limit, deadline);
+        }
+    }
+    return result;
+}
+
+void HallelujahState::scheduleSearch() {
+    cancelUpdates();
+    // The sources are kept and re-armed, so they are never destroyed from
+    // within their own callback.
+    if (!searchEvent_) {
+        searchEvent_ = engine_->instance()->eventLoop().addDeferEvent(
+            [this](EventSource *) {
+                // The budget counts from the search, not from the first key
+                // of the burst.
+                keyTime_ = Deadline::Clock::now();
+                updateCandidates(false);
+                return true;
+            });
+    }
+    searchEvent_->setOneShot();
+}
+
+void HallelujahState::scheduleRefine() {
+    if (!refineEvent_) {
+        refineEvent_ = engine_->instance()->eventLoop().addDeferEvent(
+            [this](EventSource *) {
+                updateCandidates(true);
+                return true;
+            });
+    }
+    refineEvent_->setOneShot();
+}
+
+void HallelujahState::cancelUpdates() {
+    for (auto *event : {searchEvent_.get(), refineEvent_.get(),
+                        speculationEvent_.get()}) {
+        if (event) {
+            event->setEnabled(false);
+        }
+    }
+}
+
+void HallelujahState::scheduleSpeculation() {
+    // Only the shared cache makes it pay off.
+    if (!dictionary_ || dictionary_ != engine_->dictionary(language_)) {
+        return;
+    }
+    auto normalized = lower(buffer_.userInput());
+    const auto &completion = dictionary_->completion();
+    completion.nextLetters(completion.range(normalized), normalized.size(),
+                           SpeculationLetters, speculationLetters_);
+    if (speculationLetters_.empty()) {
+        return;
+    }
+    std::reverse(speculationLetters_.begin(), speculationLetters_.end());
+    if (!speculationEvent_) {
+        speculationEvent_ = engine_->instance()->eventLoop().addDeferEvent(
+            [this](EventSource *) {
+                speculate();
+                return true;
+            });
+    }
+    speculationEvent_->setOneShot();
+}
+
+void HallelujahState::speculate() {
+    if (speculationLetters_.empty()) {
+        return;
+    }
+    auto next = lower(buffer_.userInput());
+    next += speculationLetters_.back();
+    speculationLetters_.pop_back();
+    constexpr size_t limit = PageSize + 1;
+    if (!engine_->hasPrefix(dictionary_.get(), next, limit)) {
+        Deadline deadline(Deadline::Clock::now() + SpeculationBudget);
+        auto result = rankPrefix(next, limit, deadline);
+        if (!deadline.hasExpired()) {
+            // The first page is shown with comments.
+            for (size_t i = 0; i < result.completions.size() && i < PageSize;
+                 ++i) {
+                comment(std::string(key(result.completions[i])));
             }
+            result.speculative = true;
+            engine_->cachePrefix(dictionary_.get(), next, result);
         }
     }
-    event.filterAndAccept();
-    updateUI(ic_, words, comments);
+    // Input queued meanwhile is handled before the next letter.
+    if (!speculationLetters_.empty()) {
+        speculationEvent_->setOneShot();
+    }
+}
+
+const std::string &HallelujahState::comment(const std::string &word) {
+    if (const auto *cached =
+            engine_->cachedComment(dictionary_.get(), word)) {
+        return *cached;
+    }
+    // Built in place so that the buffer is reused between candidates.
+    comment_.clear();
+    if (!dictionary_) {
+        return comment_;
+    }
+    agent_.set_query(word.data(), word.size());
+    if (!dictionary_->trie().lookup(agent_)) {
+        return comment_;
+    }
+    const auto &config = engine_->config();
+    const auto &words = dictionary_->words();
+    auto id = agent_.key().id();
+    auto ipa = words.ipa(id);
+    if (*config.showIPA && !ipa.empty()) {
+        comment_.append("[").append(ipa).append("] ");
+    }
+    if (*config.showTranslation) {
+        for (uint32_t i = 0, n = words.translationCount(id); i < n; ++i) {
+            if (i) {
+                comment_ += ' ';
+            }
+            comment_ += words.translation(id, i);
+        }
+    }
+    engine_->cacheComment(dictionary_.get(), word, comment_);
+    return comment_;
 }
 
 HallelujahEngine::HallelujahEngine(Instance *instance)
     : instance_(instance), factory_([this](InputContext &ic) {
-          return new HallelujahState(this, &ic, &trie_, &words_, &pinyin_);
-      }) {
-    loadTrie();
-    loadWords();
-    loadPinyin();
+          return new HallelujahState(this, &ic);
+      }),
+      history_(StandardPaths::global().userDirectory(
+                   StandardPathsType::PkgData) /
+               "hallelujah/history") {
     instance->inputContextManager().registerProperty("hallelujahState",
                                                      &factory_);
+    readAsIni(config_, ConfPath);
+    historyLoading_ =
+        std::async(std::launch::async, [this]() { history_.load(); }).share();
+    // The configured language is loaded ahead of the first key.
+    use(*config_.language);
+    // Updated word lists are picked up without restarting fcitx.
+    dictionaryCheckEvent_ = instance->eventLoop().addTimeEvent(
+        CLOCK_MONOTONIC, now(CLOCK_MONOTONIC) + DictionaryCheckInterval, 0,
+        [this](EventSourceTime *source, uint64_t time) {
+            reloadDictionaries();
+            source->setTime(time + DictionaryCheckInterval);
+            source->setOneShot();
+            return true;
+        });
+    unloadEvent_ = instance->eventLoop().addTimeEvent(
+        CLOCK_MONOTONIC, now(CLOCK_MONOTONIC) + UnloadCheckInterval, 0,
+        [this](EventSourceTime *source, uint64_t time) {
+            unloadIdle();
+            source->setTime(time + UnloadCheckInterval);
+            source->setOneShot();
+            return true;
+        });
+    // Lets latency spikes be diagnosed from the log without a profiler. At
+    // Info, so that it shows at the default log level.
+    statisticsEvent_ = instance->eventLoop().addTimeEvent(
+        CLOCK_MONOTONIC, now(CLOCK_MONOTONIC) + StatisticsInterval, 0,
+        [this](EventSourceTime *source, uint64_t time) {
+            HALLELUJAH_INFO() << "Statistics: " << statistics();
+            source->setTime(time + StatisticsInterval);
+            source->setOneShot();
+            return true;
+        });
 }
 
 HallelujahEngine::~HallelujahEngine() { factory_.unregister(); }
 
-void HallelujahEngine::reset(const InputMethodEntry &,
-                             InputContextEvent &event) {
-    auto ic = event.inputContext();
-    auto state = ic->propertyFor(&factory_);
-    state->reset(ic);
+std::string HallelujahEngine::language(const InputMethodEntry &entry) const {
+    constexpr std::string_view prefix = "hallelujah-";
+    const auto &name = entry.uniqueName();
+    if (name.size() > prefix.size() &&
+        name.compare(0, prefix.size(), prefix) == 0) {
+        return name.substr(prefix.size());
+    }
+    return *config_.language;
 }
 
-void HallelujahEngine::loadTrie() {
-    const auto &sp = fcitx::StandardPaths::global();
-    auto trie_path = sp.locate(fcitx::StandardPathsType::Data,
-                               "hallelujah/google_227800_words.bin");
-    if (trie_path.empty()) {
-        throw std::runtime_error("Failed to locate google_227800_words.bin");
-    }
-    std::ifstream ifs(trie_path, std::ios::binary);
-    if (!ifs) {
-        throw std::runtime_error("Failed to open google_227800_words.bin");
+const std::shared_ptr<const HallelujahDictionary> &
+HallelujahEngine::dictionary(const std::string &language) {
+    return use(language).dictionary;
+}
+
+bool HallelujahEngine::loadFailed(const std::string &code) const {
+    auto iter = languages_.find(code);
+    return iter != languages_.end() && iter->second.failedFrom &&
+           !iter->second.loading.valid();
+}
+
+HallelujahEngine::Language &HallelujahEngine::use(const std::string &code) {
+    auto [iter, inserted] = languages_.try_emplace(code);
+    auto &language = iter->second;
+    language.lastUsed = now(CLOCK_MONOTONIC);
+    if (inserted) {
+        HALLELUJAH_DEBUG() << "Loading language " << code;
+        startLoading(code, language);
     }
-    ifs >> trie_;
+    return language;
 }
 
-void HallelujahEngine::loadWords() {
-    const auto &sp = fcitx::StandardPaths::global();
-    auto words_path =
-        sp.locate(fcitx::StandardPathsType::Data, "hallelujah/words.json");
-    if (words_path.empty()) {
-        throw std::runtime_error("Failed to locate words.json");
+HallelujahEngine::Language *
+HallelujahEngine::find(const HallelujahDictionary *dictionary) {
+    if (!dictionary) {
+        return nullptr;
     }
-    std::ifstream ifs(words_path);
-    if (!ifs) {
-        throw std::runtime_error("Failed to open words.json");
+    for (auto &[code, language] : languages_) {
+        if (language.dictionary.get() == dictionary) {
+            return &language;
+        }
     }
-    json obj;
-    ifs >> obj;
-    if (!obj.is_object()) {
-        throw std::runtime_error("Invalid words.json");
+    return nullptr;
+}
+
+void HallelujahEngine::startLoading(const std::string &code,
+                                    Language &language) {
+    language.loading = std::async(
+        std::launch::async,
+        [dispatcher = &instance_->eventDispatcher(),
+         alive = std::weak_ptr<bool>(alive_), previous = language.dictionary,
+         history = historyLoading_, code, this]() {
+            auto notify = [dispatcher, alive, code, this]() {
+                dispatcher->schedule([alive, code, this]() {
+                    if (alive.lock()) {
+                        finishLoading(code);
+                    }
+                });
+            };
+            try {
+                // Parts whose files did not change are shared with the
+                // current dictionary.
+                auto dictionary =
+                    HallelujahDictionary::load(code, previous.get());
+                // Only read by the main thread once a dictionary is in.
+                history.wait();
+                notify();
+                return dictionary;
+            } catch (...) {
+                notify();
+                throw;
+            }
+        });
+}
+
+void HallelujahEngine::finishLoading(const std::string &code) {
+    auto iter = languages_.find(code);
+    // Already collected by waitForDictionary.
+    if (iter == languages_.end() || !iter->second.loading.valid()) {
+        return;
     }
-    for (auto &[key, value] : obj.items()) {
-        if (!value.is_object()) {
-            continue;
-        }
-        const auto &translation = value["translation"];
-        const auto &ipa = value["ipa"];
-        const auto &frequency = value["frequency"];
+    auto &language = iter->second;
+    // Compositions in progress keep the snapshot they started with until
+    // they are reset, and the last of them frees it.
+    try {
+        language.dictionary = language.loading.get();
+        language.failedFrom.reset();
+        language.prefixCache.clear();
+        language.commentCache.clear();
+        HALLELUJAH_DEBUG() << "Dictionary of " << code << " loaded";
+    } catch (const std::exception &e) {
+        language.failedFrom = HallelujahDictionary::fingerprint(code);
+        HALLELUJAH_ERROR() << "Failed to load dictionary of " << code << ": "
+                           << e.what();
+    }
+}
 
-        if (!translation.is_array() || !ipa.is_string() ||
-            !frequency.is_number()) {
+void HallelujahEngine::reloadDictionaries() {
+    for (auto &[code, language] : languages_) {
+        // A load in flight is checked again once it is done.
+        if (language.loading.valid()) {
             continue;
         }
-        std::vector<std::string> translations;
-        for (const auto &item : translation) {
-            if (item.is_string()) {
-                translations.emplace_back(item.get<std::string>());
+        if (language.failedFrom) {
+            // A failed load is only tried again once its files change.
+            if (HallelujahDictionary::fingerprint(code) ==
+                *language.failedFrom) {
+                continue;
             }
+        } else if (language.dictionary && !language.dictionary->outdated()) {
+            continue;
         }
-        words_.emplace(key, HallelujahWord(std::move(translations),
-                                           ipa.get<std::string>(),
-                                           frequency.get<double>()));
+        HALLELUJAH_DEBUG() << "Reloading dictionary of " << code;
+        startLoading(code, language);
     }
 }
 
-void HallelujahEngine::loadPinyin() {
-    const auto &sp = fcitx::StandardPaths::global();
-    auto pinyin_path =
-        sp.locate(fcitx::StandardPathsType::Data, "hallelujah/cedict.json");
-    if (pinyin_path.empty()) {
-        throw std::runtime_error("Failed to locate cedict.json");
-    }
-    std::ifstream ifs(pinyin_path);
-    if (!ifs) {
-        throw std::runtime_error("Failed to open cedict.json");
+void HallelujahEngine::unloadIdle() {
+    auto timeout = static_cast<uint64_t>(*config_.unloadAfter) * 60 * 1000000;
+    if (!timeout) {
+        return;
     }
-    json obj;
-    ifs >> obj;
-    if (!obj.is_object()) {
-        throw std::runtime_error("Invalid cedict.json");
+    auto time = now(CLOCK_MONOTONIC);
+    for (auto iter = languages_.begin(); iter != languages_.end();) {
+        const auto &[code, language] = *iter;
+        // A language still loading is left to finish first.
+        if (code == *config_.language || language.loading.valid() ||
+            time - language.lastUsed < timeout) {
+            ++iter;
+            continue;
+        }
+        HALLELUJAH_DEBUG() << "Unloading language " << code;
+        iter = languages_.erase(iter);
     }
+}
 
-    for (auto &[key, value] : obj.items()) {
-        if (!value.is_array()) {
+void HallelujahEngine::learn(const HallelujahDictionary *dictionary,
+                             const std::string &word) {
+    if (!*config_.userHistory || !dictionary) {
+        return;
+    }
+    // Only dictionary words, so that typos do not get ranked.
+    auto normalized = lower(word);
+    if (!dictionary->contains(normalized)) {
+        return;
+    }
+    history_.add(normalized);
+    // The word ranks differently for each of its prefixes. Decay shifts
+    // the other learnt words only slowly, so they are refreshed in bulk.
+    // The history is shared by all languages.
+    for (auto &[code, language] : languages_) {
+        if (history_.time() % PrefixCacheRefresh == 0) {
+            language.prefixCache.clear();
             continue;
         }
-        std::vector<std::string> vec;
-        for (const auto &item : value) {
-            if (item.is_string()) {
-                vec.emplace_back(item.get<std::string>());
-            }
+        for (size_t length = 1; length <= normalized.size(); ++length) {
+            language.prefixCache.erase(normalized.substr(0, length));
         }
-        pinyin_.emplace(key, std::move(vec));
     }
 }
 
-void HallelujahEngine::keyEvent(const InputMethodEntry &, KeyEvent &keyEvent) {
+const PrefixResult *
+HallelujahEngine::cachedPrefix(const HallelujahDictionary *dictionary,
+                               const std::string &normalized, size_t limit) {
+    auto *language = find(dictionary);
+    if (!language) {
+        return nullptr;
+    }
+    auto *result = language->prefixCache.find(normalized);
+    if (result && result->limit >= limit) {
+        ++prefixHits_;
+        if (result->speculative) {
+            ++speculationHits_;
+            result->speculative = false;
+        }
+        return result;
+    }
+    ++prefixMisses_;
+    return nullptr;
+}
+
+const std::string *
+HallelujahEngine::cachedComment(const HallelujahDictionary *dictionary,
+                                const std::string &word) {
+    auto *language = find(dictionary);
+    return language ? language->commentCache.find(word) : nullptr;
+}
+
+void HallelujahEngine::cacheComment(const HallelujahDictionary *dictionary,
+                                    const std::string &word,
+                                    const std::string &comment) {
+    if (auto *language = find(dictionary)) {
+        language->commentCache.insert(word, comment);
+    }
+}
+
+void HallelujahEngine::cachePrefix(const HallelujahDictionary *dictionary,
+                                   const std::string &normalized,
+                                   const PrefixResult &result) {
+    if (auto *language = find(dictionary)) {
+        language->prefixCache.insert(normalized, result);
+        speculated_ += result.speculative;
+    }
+}
+
+bool HallelujahEngine::hasPrefix(const HallelujahDictionary *dictionary,
+                                 const std::string &normalized,
+                                 size_t limit) {
+    auto *language = find(dictionary);
+    const auto *result =
+        language ? language->prefixCache.find(normalized) : nullptr;
+    return result && result->limit >= limit;
+}
+
+const std::vector<std::string> *
+HallelujahEngine::cachedSpellHint(const std::string &language,
+                                  const std::string &word) {
+    return use(language).spellCache.find(word);
+}
+
+const std::vector<std::string> &
+HallelujahEngine::spellHint(const std::string &language,
+                            const std::string &word) {
+    auto &spellCache = use(language).spellCache;
+    if (const auto *hint = spellCache.find(word)) {
+        return *hint;
+    }
+    // The spell addon is optional.
+    auto *spellAddon = spell();
+    return spellCache.insert(
+        word, spellAddon ? spellAddon->call<ISpell::hint>(language, word, 9)
+                         : std::vector<std::string>());
+}
+
+std::string HallelujahEngine::statistics() const {
+    std::string memory;
+    size_t spellCacheSize = 0;
+    size_t prefixCacheSize = 0;
+    for (const auto &[code, language] : languages_) {
+        memory += fmt::format(
+            R"({}"{}":{})", memory.empty() ? "" : ",", code,
+            language.dictionary ? language.dictionary->memoryJson() : "null");
+        spellCacheSize += language.spellCache.size();
+        prefixCacheSize += language.prefixCache.size();
+    }
+    // The history is filled in by another thread until it is loaded.
+    auto history = historyLoading_.wait_for(std::chrono::seconds(0)) ==
+                           std::future_status::ready
+                       ? std::to_string(history_.size())
+                       : std::string(R"("loading")");
+    return fmt::format(
+        R"({{"instrumented":{},"stages":{},"memory":{{{}}},"spell_cache":{},)"
+        R"("prefix_cache":{{"size":{},"hits":{},"misses":{}}},)"
+        R"("budget":{{"ms":{},"hits":{}}},)"
+        R"("speculation":{{"prefixes":{},"hits":{}}},"history":{}}})",
+        StatisticsEnabled, latency_.toJson(), memory, spellCacheSize,
+        prefixCacheSize, prefixHits_, prefixMisses_, *config_.latencyBudget,
+        budgetHits_, speculated_, speculationHits_, history);
+}
+
+bool HallelujahEngine::waitForDictionary() {
+    const auto &code = *config_.language;
+    auto &language = use(code);
+    finishLoading(code);
+    return language.dictionary != nullptr;
+}
+
+void HallelujahEngine::reset(const InputMethodEntry &,
+                             InputContextEvent &event) {
+    auto ic = event.inputContext();
+    auto state = ic->propertyFor(&factory_);
+    state->reset(ic);
+}
+
+void HallelujahEngine::keyEvent(const InputMethodEntry &entry,
+                                KeyEvent &keyEvent) {
     if (keyEvent.isRelease() || keyEvent.key().states()) {
         return;
     }
     auto ic = keyEvent.inputContext();
     auto *state = ic->propertyFor(&factory_);
+    // Also keeps the language from being unloaded while it is typed in.
+    auto code = language(entry);
+    use(code);
+    state->setLanguage(code);
     state->keyEvent(keyEvent);
 }
 
-void HallelujahEngine::reloadConfig() { readAsIni(config_, ConfPath); }
+void HallelujahEngine::reloadConfig() {
+    readAsIni(config_, ConfPath);
+    // The ranking depends on UserHistory, the comments on ShowIPA and
+    // ShowTranslation.
+    for (auto &[code, language] : languages_) {
+        language.prefixCache.clear();
+        language.commentCache.clear();
+    }
+    use(*config_.language);
+    reloadDictionaries();
+}
 
 void HallelujahEngine::setConfig(const RawConfig &config) {
     config_.load(config, true);
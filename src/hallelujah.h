@@ -1,18 +1,37 @@
 #ifndef _FCITX5_HALLELUJAH_HALLELUJAH_H_
 #define _FCITX5_HALLELUJAH_HALLELUJAH_H_
 
+#include "completion.h"
+#include "dictionary.h"
+#include "hallelujah_public.h"
+#include "lrucache.h"
+#include "statistics.h"
+#include "userhistory.h"
 #include <fcitx-config/iniparser.h>
+#include <fcitx-utils/event.h>
 #include <fcitx-utils/i18n.h>
 #include <fcitx-utils/inputbuffer.h>
+#include <fcitx-utils/log.h>
 #include <fcitx/addonmanager.h>
+#include <fcitx/candidatelist.h>
 #include <fcitx/inputcontext.h>
 #include <fcitx/inputcontextproperty.h>
 #include <fcitx/inputmethodengine.h>
 #include <fcitx/instance.h>
-#include <marisa/trie.h>
-#include <unordered_map>
+#include <future>
+#include <map>
+#include <memory>
+#include <optional>
 
 namespace fcitx::hallelujah {
+FCITX_DECLARE_LOG_CATEGORY(hallelujah);
+
+inline constexpr size_t PageSize = 10;
+#define HALLELUJAH_DEBUG() FCITX_LOGC(::fcitx::hallelujah::hallelujah, Debug)
+#define HALLELUJAH_INFO() FCITX_LOGC(::fcitx::hallelujah::hallelujah, Info)
+#define HALLELUJAH_ERROR() FCITX_LOGC(::fcitx::hallelujah::hallelujah, Error)
+#define HALLELUJAH_WARN() FCITX_LOGC(::fcitx::hallelujah::hallelujah, Warn)
+
 enum class PreeditMode { No, ComposingText };
 
 FCITX_CONFIG_ENUM_NAME_WITH_I18N(PreeditMode, N_("Do not show"),
@@ -26,41 +45,117 @@ FCITX_CONFIGURATION(
     Option<bool> showTranslation{this, "ShowTranslation", _("Show translation"),
                                  true};
     Option<bool> commitWithSpace{this, "CommitWithSpace",
-                                 _("Commit with space"), false};);
-
-struct HallelujahWord {
-    HallelujahWord(const std::vector<std::string> &translation,
-                   const std::string &ipa, double frequency)
-        : translation_(translation), ipa_(ipa), frequency_(frequency) {}
-    std::vector<std::string> translation_;
-    std::string ipa_;
-    double frequency_;
-};
+                                 _("Commit with space"), false};
+    Option<bool> userHistory{this, "UserHistory",
+                             _("Rank committed words higher"), true};
+    Option<bool> prediction{this, "Prediction", _("Predict the next word"),
+                            true};
+    Option<int, IntConstrain> latencyBudget{
+        this, "LatencyBudget",
+        _("Time budget per key in milliseconds (0 for unlimited)"), 20,
+        IntConstrain(0, 1000)};
+    Option<std::string> language{this, "Language", _("Language"),
+                                 HallelujahDictionary::DefaultLanguage};
+    Option<int, IntConstrain> unloadAfter{
+        this, "UnloadAfter",
+        _("Unload other languages unused for minutes (0 to keep them)"), 30,
+        IntConstrain(0, 1440)};);
 
 class HallelujahEngine;
 
+// Ranks of the candidates of a prefix in the completion indexes.
+struct PrefixResult {
+    size_t limit = 0;
+    // The best limit completions over all layers.
+    std::vector<LayeredRank> completions;
+    // Typo corrections from the system layer, if there are fewer
+    // completions than limit.
+    std::vector<uint32_t> corrections;
+    // Computed ahead of the key that would need it, and not used since.
+    bool speculative = false;
+};
+
 class HallelujahState : public InputContextProperty {
 public:
-    HallelujahState(
-        HallelujahEngine *engine, InputContext *ic, marisa::Trie *trie,
-        std::unordered_map<std::string, HallelujahWord> *words,
-        std::unordered_map<std::string, std::vector<std::string>> *pinyin)
-        : engine_(engine), ic_(ic), trie_(trie), words_(words),
-          pinyin_(pinyin) {}
+    HallelujahState(HallelujahEngine *engine, InputContext *ic)
+        : engine_(engine), ic_(ic) {}
     void keyEvent(KeyEvent &keyEvent);
-    void updateUI(InputContext *ic, const std::vector<std::string> &words,
-                  const std::vector<std::string> &candidates);
+    void updateUI(InputContext *ic,
+                  std::unique_ptr<CandidateList> candidateList);
     void reset(InputContext *ic);
+    // Commits a candidate and shows the words likely to follow it.
+    void commit(InputContext *ic, std::string word, bool withSpace);
     HallelujahEngine *engine() { return engine_; }
+    // Follows the input method entry of the key being handled.
+    void setLanguage(const std::string &language) { language_ = language; }
+    // The first limit candidates for the normalized input, starting with
+    // the input itself. Unless complete, the search stops with what it has
+    // once the latency budget of the key is spent, and the slow stages are
+    // finished once the event loop is idle.
+    std::vector<std::string> candidates(const std::string &normalized,
+                                        size_t limit, bool complete);
+    // Valid until the next call.
+    const std::string &comment(const std::string &word);
 
 private:
     void updatePreedit(InputContext *ic);
+    void predict(InputContext *ic, const std::string &word);
+    void updateCandidates(bool complete);
+    void search(const std::string &normalized,
+                std::vector<std::string> &words, size_t limit,
+                bool complete, Deadline &deadline);
+    PrefixResult rankPrefix(const std::string &normalized, size_t limit,
+                            Deadline &deadline);
+    // Blends the user history into the static ranking of completions.
+    void rerank(const std::string &normalized,
+                std::vector<LayeredRank> &ranks);
+    std::string_view key(LayeredRank item) const {
+        return dictionary_->layers()[item.layer]->key(item.rank);
+    }
+    // Searches for the buffer once the event loop is idle, so that keys
+    // arriving in a burst share one search.
+    void scheduleSearch();
+    // Runs the search again without a deadline and with the spell
+    // suggestions, once the event loop is idle.
+    void scheduleRefine();
+    void cancelUpdates();
+    // Ranks the likeliest next prefixes of the buffer ahead of time, one
+    // per event loop iteration. Any key cancels it.
+    void scheduleSpeculation();
+    void speculate();
+    bool updatePending() const {
+        return (searchEvent_ && searchEvent_->isEnabled()) ||
+               (refineEvent_ && refineEvent_->isEnabled());
+    }
+
     HallelujahEngine *engine_;
     InputContext *ic_;
     InputBuffer buffer_{{InputBufferOption::AsciiOnly}};
-    marisa::Trie *trie_;
-    std::unordered_map<std::string, HallelujahWord> *words_;
-    std::unordered_map<std::string, std::vector<std::string>> *pinyin_;
+    std::string language_ = HallelujahDictionary::DefaultLanguage;
+    // Pinned for the whole composition so that context_ stays valid.
+    std::shared_ptr<const HallelujahDictionary> dictionary_;
+    CompletionContext context_;
+    // Scratch buffers of the keystroke path, kept to reuse their capacity.
+    marisa::Agent agent_;
+    std::string comment_;
+    std::vector<std::string_view> historyWords_;
+    std::vector<uint32_t> predicted_;
+    std::vector<std::pair<double, LayeredRank>> scored_;
+    std::unique_ptr<EventSource> searchEvent_;
+    std::unique_ptr<EventSource> refineEvent_;
+    std::unique_ptr<EventSource> speculationEvent_;
+    // Next letters still to be speculated on, last first.
+    std::string speculationLetters_;
+    // Next letters speculated on after each search, and the time each may
+    // take.
+    static constexpr size_t SpeculationLetters = 3;
+    static constexpr auto SpeculationBudget = std::chrono::milliseconds(2);
+    // When the key being handled was received.
+    Deadline::Clock::time_point keyTime_;
+    // Whether Tab has moved into the predictions on display.
+    bool selectingPrediction_ = false;
+    // Whether the last word committed was followed by a space.
+    bool lastCommitSpaced_ = true;
 };
 
 class HallelujahEngine final : public InputMethodEngine {
@@ -74,20 +169,109 @@ public:
     void setConfig(const RawConfig &config) override;
     void reloadConfig() override;
     const HallelujahEngineConfig &config() const { return config_; }
+    // Language of the plain entry is configured, any other entry is named
+    // hallelujah-<language>.
+    std::string language(const InputMethodEntry &entry) const;
+    // Null until the language has loaded in the background, which its
+    // first use starts.
+    const std::shared_ptr<const HallelujahDictionary> &
+    dictionary(const std::string &language);
+    // Whether the last load of the language failed. It is not loaded
+    // again until its files change.
+    bool loadFailed(const std::string &language) const;
+    // Blocks until the configured language has loaded. Returns whether a
+    // dictionary is available.
+    bool waitForDictionary();
+    Instance *instance() { return instance_; }
+    // Candidates of a prefix, shared by all input contexts using the same
+    // language. Results for any dictionary other than the current one of a
+    // language are neither kept nor found.
+    const PrefixResult *cachedPrefix(const HallelujahDictionary *dictionary,
+                                     const std::string &normalized,
+                                     size_t limit);
+    // Formatted comments, keyed by word in the same way.
+    const std::string *cachedComment(const HallelujahDictionary *dictionary,
+                                     const std::string &word);
+    void cacheComment(const HallelujahDictionary *dictionary,
+                      const std::string &word, const std::string &comment);
+    void cachePrefix(const HallelujahDictionary *dictionary,
+                     const std::string &normalized, const PrefixResult &result);
+    // Whether a prefix is cached, without counting it as a lookup.
+    bool hasPrefix(const HallelujahDictionary *dictionary,
+                   const std::string &normalized, size_t limit);
+    // Spell suggestions in a language, shared by all input contexts.
+    const std::vector<std::string> *
+    cachedSpellHint(const std::string &language, const std::string &word);
+    const std::vector<std::string> &spellHint(const std::string &language,
+                                              const std::string &word);
+    Statistics &latency() { return latency_; }
+    const UserHistory &history() const { return history_; }
+    // Records a committed word in the user history, if it is in the
+    // dictionary it was typed with.
+    void learn(const HallelujahDictionary *dictionary,
+               const std::string &word);
+    // Counts a key whose candidates were cut short by the latency budget.
+    void budgetExceeded() { ++budgetHits_; }
+    std::string statistics() const;
+    FCITX_ADDON_EXPORT_FUNCTION(HallelujahEngine, waitForDictionary);
+    FCITX_ADDON_EXPORT_FUNCTION(HallelujahEngine, statistics);
     FCITX_ADDON_DEPENDENCY_LOADER(spell, instance_->addonManager());
 
 private:
-    void loadWords();
-    void loadTrie();
-    void loadPinyin();
+    // The dictionary set of a language and what is cached for it.
+    struct Language {
+        std::shared_ptr<const HallelujahDictionary> dictionary;
+        std::future<std::shared_ptr<const HallelujahDictionary>> loading;
+        LRUCache<std::string, std::vector<std::string>> spellCache{1024};
+        LRUCache<std::string, PrefixResult> prefixCache{4096};
+        LRUCache<std::string, std::string> commentCache{4096};
+        // CLOCK_MONOTONIC time of the last use.
+        uint64_t lastUsed = 0;
+        // Fingerprint of the files, if the last load failed.
+        std::optional<std::string> failedFrom;
+    };
+
+    // Starts loading the language on first use.
+    Language &use(const std::string &code);
+    // The language whose current dictionary it is.
+    Language *find(const HallelujahDictionary *dictionary);
+    void startLoading(const std::string &code, Language &language);
+    void finishLoading(const std::string &code);
+    // Loads the dictionaries again in the background if their files
+    // changed since they were loaded or failed to load. The current ones
+    // stay in use until then.
+    void reloadDictionaries();
+    // Drops the languages other than the configured one that were not
+    // used for UnloadAfter. Compositions still holding a dictionary keep
+    // it until they are reset.
+    void unloadIdle();
 
     Instance *instance_;
     HallelujahEngineConfig config_;
     FactoryFor<HallelujahState> factory_;
-    marisa::Trie trie_;
-    std::unordered_map<std::string, HallelujahWord> words_;
-    std::unordered_map<std::string, std::vector<std::string>> pinyin_;
+    // Declared before historyLoading_, which loads it.
+    UserHistory history_;
+    // Dictionaries only become available once it is done, so that the
+    // history is never read while it loads.
+    std::shared_future<void> historyLoading_;
+    // Ordered so that the statistics are stable.
+    std::map<std::string, Language> languages_;
+    uint64_t prefixHits_ = 0;
+    uint64_t prefixMisses_ = 0;
+    uint64_t budgetHits_ = 0;
+    uint64_t speculated_ = 0;
+    uint64_t speculationHits_ = 0;
+    Statistics latency_;
+    std::unique_ptr<EventSourceTime> dictionaryCheckEvent_;
+    std::unique_ptr<EventSourceTime> unloadEvent_;
+    std::unique_ptr<EventSourceTime> statisticsEvent_;
+    // Lets callbacks queued by the loader detect that the engine is gone.
+    std::shared_ptr<bool> alive_ = std::make_shared<bool>(true);
     static const inline std::string ConfPath = "conf/hallelujah.conf";
+    static constexpr uint64_t StatisticsInterval = 300 * 1000000ULL;
+    static constexpr uint64_t DictionaryCheckInterval = 60 * 1000000ULL;
+    static constexpr uint64_t UnloadCheckInterval = 60 * 1000000ULL;
+    static constexpr uint64_t PrefixCacheRefresh = 100;
 };
 } // namespace fcitx::hallelujah
 
@@ -0,0 +1,15 @@
+#ifndef _FCITX5_HALLELUJAH_HALLELUJAH_PUBLIC_H_
+#define _FCITX5_HALLELUJAH_HALLELUJAH_PUBLIC_H_
+
+#include <fcitx/addoninstance.h>
+#include <string>
+
+// Blocks until the dictionaries of the configured language have been loaded
+// in the background. Returns false if loading failed.
+FCITX_ADDON_DECLARE_FUNCTION(HallelujahEngine, waitForDictionary, bool());
+
+// Per-stage keystroke latency histograms (when built with
+// ENABLE_STATISTICS) and dictionary memory usage, as a JSON object.
+FCITX_ADDON_DECLARE_FUNCTION(HallelujahEngine, statistics, std::string());
+
+#endif
@@ -0,0 +1,534 @@
+#include "jsondict.h"
+#include "dictformat.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <nlohmann/json.hpp>
+#include <stdexcept>
+#include <sys/resource.h>
+#include <zdict.h>
+#include <zstd.h>
+
+namespace fcitx::hallelujah {
+
+namespace {
+
+using json = nlohmann::json;
+
+// Accepts and ignores every event, for handlers to override the ones they
+// care about.
+class IgnoringSax : public nlohmann::json_sax<json> {
+public:
+    explicit IgnoringSax(std::string path) : path_(std::move(path)) {}
+
+    bool null() override { return true; }
+    bool boolean(bool) override { return true; }
+    bool number_integer(number_integer_t) override { return true; }
+    bool number_unsigned(number_unsigned_t) override { return true; }
+    bool number_float(number_float_t, const string_t &) override {
+        return true;
+    }
+    bool string(string_t &) override { return true; }
+    bool binary(binary_t &) override { return true; }
+    bool start_object(std::size_t) override { return true; }
+    bool key(string_t &) override { return true; }
+    bool end_object() override { return true; }
+    bool start_array(std::size_t) override { return true; }
+    bool end_array() override { return true; }
+    bool parse_error(std::size_t, const std::string &,
+                     const nlohmann::detail::exception &e) override {
+        throw std::runtime_error("Invalid " + path_ + ": " + e.what());
+    }
+
+protected:
+    std::string path_;
+};
+
+// words.json. Depth 1 holds the words, depth 2 the fields of a word and
+// depth 3 its translations.
+class WordsSax : public IgnoringSax {
+public:
+    using Entry = std::function<void(std::string_view word, double frequency,
+                                     std::string_view ipa,
+                                     const std::vector<std::string> &)>;
+
+    WordsSax(std::string path, Entry entry, JsonStats &stats)
+        : IgnoringSax(std::move(path)), entry_(std::move(entry)),
+          stats_(stats) {}
+
+    bool number_integer(number_integer_t value) override {
+        return number(value);
+    }
+    bool number_unsigned(number_unsigned_t value) override {
+        return number(value);
+    }
+    bool number_float(number_float_t value, const string_t &) override {
+        return number(value);
+    }
+    bool string(string_t &value) override {
+        if (depth_ == 2 && field_ == "ipa") {
+            ipa_ = std::move(value);
+            hasIpa_ = true;
+        } else if (depth_ == 3 && inTranslation_) {
+            translations_.push_back(std::move(value));
+        } else {
+            scalar();
+        }
+        return true;
+    }
+    bool null() override { return scalar(); }
+    bool boolean(bool) override { return scalar(); }
+    bool key(string_t &value) override {
+        if (depth_ == 1) {
+            word_ = std::move(value);
+        } else if (depth_ == 2) {
+            field_ = std::move(value);
+        }
+        return true;
+    }
+    bool start_object(std::size_t) override {
+        if (depth_ == 0) {
+            top_ = true;
+        } else if (depth_ == 1) {
+            hasIpa_ = hasFrequency_ = hasTranslation_ = false;
+            translations_.clear();
+        }
+        ++depth_;
+        return true;
+    }
+    bool end_object() override {
+        if (--depth_ == 1) {
+            ++stats_.entries;
+            if (hasIpa_ && hasFrequency_ && hasTranslation_) {
+                entry_(word_, frequency_, ipa_, translations_);
+            } else {
+                ++stats_.invalid;
+            }
+        }
+        return true;
+    }
+    bool start_array(std::size_t) override {
+        if (depth_ == 1) {
+            ++stats_.entries;
+            ++stats_.invalid;
+        } else if (depth_ == 2 && field_ == "translation") {
+            inTranslation_ = hasTranslation_ = true;
+        }
+        ++depth_;
+        return true;
+    }
+    bool end_array() override {
+        if (--depth_ == 2) {
+            inTranslation_ = false;
+        }
+        return true;
+    }
+
+    // Whether the document was an object.
+    bool valid() const { return top_; }
+
+private:
+    bool number(double value) {
+        if (depth_ == 2 && field_ == "frequency") {
+            frequency_ = value;
+            hasFrequency_ = true;
+        } else {
+            scalar();
+        }
+        return true;
+    }
+    // A word whose value is not an object.
+    bool scalar() {
+        if (depth_ == 1) {
+            ++stats_.entries;
+            ++stats_.invalid;
+        }
+        return true;
+    }
+
+    Entry entry_;
+    JsonStats &stats_;
+    size_t depth_ = 0;
+    bool top_ = false;
+    std::string word_;
+    std::string field_;
+    std::string ipa_;
+    double frequency_ = 0;
+    std::vector<std::string> translations_;
+    bool hasIpa_ = false;
+    bool hasFrequency_ = false;
+    bool hasTranslation_ = false;
+    bool inTranslation_ = false;
+};
+
+// cedict.json. Depth 1 holds the pinyin, depth 2 its glosses.
+class PinyinSax : public IgnoringSax {
+public:
+    using Entry = std::function<void(std::string_view pinyin,
+                                     const std::vector<std::string> &)>;
+
+    PinyinSax(std::string path, Entry entry, JsonStats &stats)
+        : IgnoringSax(std::move(path)), entry_(std::move(entry)),
+          stats_(stats) {}
+
+    bool string(string_t &value) override {
+        if (depth_ == 2 && inGlosses_) {
+            glosses_.push_back(std::move(value));
+        } else if (depth_ == 1) {
+            invalid();
+        }
+        return true;
+    }
+    bool null() override { return depth_ == 1 ? invalid() : true; }
+    bool boolean(bool) override { return depth_ == 1 ? invalid() : true; }
+    bool number_integer(number_integer_t) override {
+        return depth_ == 1 ? invalid() : true;
+    }
+    bool number_unsigned(number_unsigned_t) override {
+        return depth_ == 1 ? invalid() : true;
+    }
+    bool number_float(number_float_t, const string_t &) override {
+        return depth_ == 1 ? invalid() : true;
+    }
+    bool key(string_t &value) override {
+        if (depth_ == 1) {
+            pinyin_ = std::move(value);
+        }
+        return true;
+    }
+    bool start_object(std::size_t) override {
+        if (depth_ == 0) {
+            top_ = true;
+        } else if (depth_ == 1) {
+            invalid();
+        }
+        ++depth_;
+        return true;
+    }
+    bool end_object() override {
+        --depth_;
+        return true;
+    }
+    bool start_array(std::size_t) override {
+        if (depth_ == 1) {
+            inGlosses_ = true;
+            glosses_.clear();
+        }
+        ++depth_;
+        return true;
+    }
+    bool end_array() override {
+        if (--depth_ == 1) {
+            inGlosses_ = false;
+            ++stats_.entries;
+            if (pinyin_.empty()) {
+                ++stats_.invalid;
+            } else {
+                entry_(pinyin_, glosses_);
+            }
+        }
+        return true;
+    }
+
+    bool valid() const { return top_; }
+
+private:
+    bool invalid() {
+        ++stats_.entries;
+        ++stats_.invalid;
+        return true;
+    }
+
+    Entry entry_;
+    JsonStats &stats_;
+    size_t depth_ = 0;
+    bool top_ = false;
+    bool inGlosses_ = false;
+    std::string pinyin_;
+    std::vector<std::string> glosses_;
+};
+
+// Fills in the time taken since start and the peak RSS of stats.
+void measure(std::chrono::steady_clock::time_point start, JsonStats &stats) {
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        stats.peakRssKb = usage.ru_maxrss;
+    }
+}
+
+// Streams a mapped file through handler and fills in the timing of stats.
+template <typename Sax>
+void parse(const std::string &path, Sax &handler, JsonStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+    MappedFile file;
+    file.open(path);
+    json::sax_parse(file.data(), file.data() + file.size(), &handler);
+    if (!handler.valid()) {
+        throw std::runtime_error("Invalid " + path);
+    }
+    measure(start, stats);
+}
+
+} // namespace
+
+size_t WordStoreBuilder::numTranslations() const {
+    size_t count = 0;
+    for (const auto &entry : entries_) {
+        count += entry.translations.size();
+    }
+    return count;
+}
+
+size_t WordStoreBuilder::payloadsSize() const {
+    size_t size = 0;
+    for (size_t i = 0; i < entries_.size(); i += BlockRecords) {
+        size += block(i / BlockRecords).size();
+    }
+    return size;
+}
+
+std::string WordStoreBuilder::block(size_t i) const {
+    std::string data;
+    auto append = [&data](std::string_view s) {
+        auto length = static_cast<uint32_t>(s.size());
+        data.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        data.append(s);
+    };
+    auto end = std::min(entries_.size(), (i + 1) * BlockRecords);
+    for (auto id = i * BlockRecords; id < end; ++id) {
+        const auto &entry = entries_[id];
+        append(entry.ipa);
+        auto count = static_cast<uint32_t>(entry.translations.size());
+        data.append(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (const auto &translation : entry.translations) {
+            append(translation);
+        }
+    }
+    return data;
+}
+
+std::string WordStoreBuilder::serialize(int level,
+                                        size_t dictionarySize) const {
+    auto numBlocks = (entries_.size() + BlockRecords - 1) / BlockRecords;
+    std::string samples;
+    std::vector<size_t> sampleSizes;
+    for (size_t i = 0; i < numBlocks; ++i) {
+        auto data = block(i);
+        samples += data;
+        sampleSizes.push_back(data.size());
+    }
+
+    // Past about a hundredth of the samples, a larger dictionary costs
+    // more than it saves.
+    dictionarySize = std::min(dictionarySize, samples.size() / 100);
+    std::string dictionary;
+    if (dictionarySize) {
+        dictionary.resize(dictionarySize);
+        auto size = ZDICT_trainFromBuffer(
+            dictionary.data(), dictionary.size(), samples.data(),
+            sampleSizes.data(), static_cast<unsigned>(sampleSizes.size()));
+        // Training fails on too little data, which then compresses well
+        // enough without.
+        dictionary.resize(ZDICT_isError(size) ? 0 : size);
+    }
+
+    std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> context(
+        ZSTD_createCCtx(), ZSTD_freeCCtx);
+    std::unique_ptr<ZSTD_CDict, decltype(&ZSTD_freeCDict)> cdict(
+        dictionary.empty() ? nullptr
+                           : ZSTD_createCDict(dictionary.data(),
+                                              dictionary.size(), level),
+        ZSTD_freeCDict);
+    if (!context || (!dictionary.empty() && !cdict)) {
+        throw std::runtime_error("Failed to create zstd compressor");
+    }
+    std::string payloads;
+    std::vector<uint64_t> blocks{0};
+    std::string frame;
+    const char *sample = samples.data();
+    for (auto sampleSize : sampleSizes) {
+        frame.resize(ZSTD_compressBound(sampleSize));
+        auto size =
+            cdict ? ZSTD_compress_usingCDict(context.get(), frame.data(),
+                                             frame.size(), sample, sampleSize,
+                                             cdict.get())
+                  : ZSTD_compressCCtx(context.get(), frame.data(),
+                                      frame.size(), sample, sampleSize,
+                                      level);
+        if (ZSTD_isError(size)) {
+            throw std::runtime_error(std::string("Failed to compress: ") +
+                                     ZSTD_getErrorName(size));
+        }
+        payloads.append(frame.data(), size);
+        blocks.push_back(payloads.size());
+        sample += sampleSize;
+    }
+
+    format::WordFileHeader header{};
+    std::memcpy(header.magic, format::WordMagic, sizeof(header.magic));
+    header.version = format::WordVersion;
+    header.numRecords = entries_.size();
+    header.blockRecords = BlockRecords;
+    header.frequenciesOffset = sizeof(header);
+    header.blocksOffset =
+        header.frequenciesOffset + entries_.size() * sizeof(double);
+    header.dictionaryOffset =
+        header.blocksOffset + blocks.size() * sizeof(uint64_t);
+    header.dictionarySize = dictionary.size();
+    header.payloadsOffset = header.dictionaryOffset + dictionary.size();
+    header.payloadsSize = payloads.size();
+
+    std::string image;
+    image.reserve(header.payloadsOffset + header.payloadsSize);
+    auto append = [&image](const void *data, size_t size) {
+        image.append(static_cast<const char *>(data), size);
+    };
+    append(&header, sizeof(header));
+    for (const auto &entry : entries_) {
+        append(&entry.frequency, sizeof(entry.frequency));
+    }
+    append(blocks.data(), blocks.size() * sizeof(uint64_t));
+    image += dictionary;
+    image += payloads;
+    return image;
+}
+
+size_t WordStoreBuilder::write(const std::string &path) const {
+    auto image = serialize();
+    std::ofstream out(path, std::ios::binary);
+    out.write(image.data(), image.size());
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+    return image.size();
+}
+
+WordStoreBuilder compileWordsJson(const marisa::Trie &trie,
+                                  const std::string &path, JsonStats &stats) {
+    WordStoreBuilder builder(trie.num_keys());
+    marisa::Agent agent;
+    WordsSax handler(
+        path,
+        [&](std::string_view word, double frequency, std::string_view ipa,
+            const std::vector<std::string> &translations) {
+            agent.set_query(word.data(), word.size());
+            if (!trie.lookup(agent)) {
+                ++stats.missing;
+                return;
+            }
+            builder.set(agent.key().id(),
+                        builder.make(frequency, ipa, translations));
+        },
+        stats);
+    parse(path, handler, stats);
+    return builder;
+}
+
+void readWordCounts(
+    const std::string &path,
+    const std::function<void(size_t line, std::string_view word,
+                             double count)> &entry,
+    const std::function<void(size_t line, const std::string &message)>
+        &error) {
+    std::ifstream in(path);
+    if (!in) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0) {
+            error(number, "expected a word and its count");
+            continue;
+        }
+        auto word = std::string_view(line).substr(0, tab);
+        char *end = nullptr;
+        auto count = std::strtod(line.c_str() + tab + 1, &end);
+        bool parsed = end != line.c_str() + tab + 1;
+        while (std::isspace(static_cast<unsigned char>(*end))) {
+            ++end;
+        }
+        if (!parsed || *end != '\0' || !std::isfinite(count) || count <= 0) {
+            error(number, "invalid count of " + std::string(word));
+            continue;
+        }
+        if (std::any_of(word.begin(), word.end(), [](unsigned char c) {
+                return std::isupper(c) || std::isspace(c);
+            })) {
+            error(number, std::string(word) + " is not lowercase");
+            continue;
+        }
+        entry(number, word, count);
+    }
+}
+
+void applyWordCounts(const marisa::Trie &trie, const std::string &path,
+                     WordStoreBuilder &builder, JsonStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+    marisa::Agent agent;
+    readWordCounts(
+        path,
+        [&](size_t, std::string_view word, double count) {
+            ++stats.entries;
+            agent.set_query(word.data(), word.size());
+            if (!trie.lookup(agent)) {
+                ++stats.missing;
+                return;
+            }
+            builder.setFrequency(agent.key().id(), count);
+        },
+        [&stats](size_t, const std::string &) {
+            ++stats.entries;
+            ++stats.invalid;
+        });
+    measure(start, stats);
+}
+
+WordStoreBuilder compilePinyinJson(const marisa::Trie &wordsTrie,
+                                   const WordStore &words,
+                                   const std::string &path,
+                                   marisa::Trie &pinyinTrie,
+                                   JsonStats &stats) {
+    // Records are made in file order and placed once the trie has assigned
+    // the IDs.
+    WordStoreBuilder builder;
+    marisa::Keyset keyset;
+    std::vector<WordStoreBuilder::Entry> records;
+    marisa::Agent agent;
+    PinyinSax handler(
+        path,
+        [&](std::string_view pinyin, const std::vector<std::string> &glosses) {
+            double frequency = 0;
+            for (const auto &gloss : glosses) {
+                agent.set_query(gloss.data(), gloss.size());
+                if (wordsTrie.lookup(agent)) {
+                    frequency = std::max(frequency,
+                                         words.frequency(agent.key().id()));
+                }
+            }
+            // Frequent pinyin comes first among its siblings in the trie.
+            keyset.push_back(pinyin.data(), pinyin.size(),
+                             static_cast<float>(frequency));
+            records.push_back(builder.make(frequency, {}, glosses));
+        },
+        stats);
+    parse(path, handler, stats);
+
+    pinyinTrie.build(keyset, MARISA_WEIGHT_ORDER);
+    builder.resize(pinyinTrie.num_keys());
+    for (size_t i = 0; i < keyset.size(); ++i) {
+        builder.set(keyset[i].id(), std::move(records[i]));
+    }
+    return builder;
+}
+
+} // namespace fcitx::hallelujah
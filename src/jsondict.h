@@ -0,0 +1,121 @@
+#ifndef _FCITX5_HALLELUJAH_JSONDICT_H_
+#define _FCITX5_HALLELUJAH_JSONDICT_H_
+
+#include "wordstore.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <marisa/trie.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compiles the JSON dictionaries into the words.bin format. Shared by
+// hallelujah-dict and by the addon, which falls back to the JSON files when
+// the compiled ones are not installed.
+namespace fcitx::hallelujah {
+
+// Builds a words.bin image, compressing the payloads.
+class WordStoreBuilder {
+public:
+    struct Entry {
+        double frequency = 0;
+        std::string ipa;
+        std::vector<std::string> translations;
+    };
+
+    // Records per compressed block. Small enough that decoding the block of
+    // a word on display takes microseconds, large enough for the frames to
+    // compress well with a trained dictionary.
+    static constexpr uint32_t BlockRecords = 16;
+    // For the files built once by hallelujah-dict. The addon compiling the
+    // JSON files at load time trades size for speed instead.
+    static constexpr int BuildLevel = 19;
+    static constexpr size_t BuildDictionarySize = 64 * 1024;
+
+    explicit WordStoreBuilder(uint32_t numRecords = 0)
+        : entries_(numRecords) {}
+
+    // An entry, which still has to be placed with set().
+    static Entry make(double frequency, std::string_view ipa,
+                      const std::vector<std::string> &translations) {
+        return {frequency, std::string(ipa), translations};
+    }
+    void set(uint32_t id, Entry entry) { entries_[id] = std::move(entry); }
+    double frequency(uint32_t id) const { return entries_[id].frequency; }
+    void setFrequency(uint32_t id, double frequency) {
+        entries_[id].frequency = frequency;
+    }
+    void resize(uint32_t numRecords) { entries_.resize(numRecords); }
+
+    size_t numRecords() const { return entries_.size(); }
+    size_t numTranslations() const;
+    // Bytes of the payloads before compression.
+    size_t payloadsSize() const;
+    // Compresses the payloads at level, with a dictionary of at most
+    // dictionarySize bytes trained on them, or none if 0 or if there are
+    // too few payloads to train one. The result does not depend on
+    // anything but the entries and the arguments.
+    std::string serialize(int level = BuildLevel,
+                          size_t dictionarySize = BuildDictionarySize) const;
+    // Returns the size of the file. Throws std::runtime_error on failure.
+    size_t write(const std::string &path) const;
+
+private:
+    // The uncompressed content of block i.
+    std::string block(size_t i) const;
+
+    std::vector<Entry> entries_;
+};
+
+struct JsonStats {
+    size_t entries = 0;
+    // Entries whose key is not in the trie.
+    size_t missing = 0;
+    // Entries of the wrong shape, which are skipped.
+    size_t invalid = 0;
+    double seconds = 0;
+    // Peak resident set size of the process once done, in KiB.
+    long peakRssKb = 0;
+};
+
+// Compiles words.json, an object of
+//   "word": {"translation": [...], "ipa": "...", "frequency": n}
+// into records indexed by the key IDs of trie. The file is mapped and
+// streamed through a SAX parser, so no document is ever built. Throws
+// std::runtime_error if the file cannot be read or is not valid JSON.
+WordStoreBuilder compileWordsJson(const marisa::Trie &trie,
+                                  const std::string &path, JsonStats &stats);
+
+// Reads a word list of "word\tcount" lines, such as
+// google_227800_words.txt. It is what the word trie is built from, and
+// its counts are the frequencies words rank by. Words must be lowercase,
+// since input is lowercased before it is looked up. Calls entry for every
+// valid line, and error with the line number and a message for every other
+// one. Throws std::runtime_error if the file cannot be read.
+void readWordCounts(
+    const std::string &path,
+    const std::function<void(size_t line, std::string_view word,
+                             double count)> &entry,
+    const std::function<void(size_t line, const std::string &message)>
+        &error);
+
+// Sets the frequencies of records compiled for trie to the counts of a
+// word list, as hallelujah-dict build does, so that words.json compiled at
+// load time ranks the same as words.bin. Words of the list that are not in
+// the trie are counted as missing, and invalid lines as invalid.
+void applyWordCounts(const marisa::Trie &trie, const std::string &path,
+                     WordStoreBuilder &builder, JsonStats &stats);
+
+// Compiles cedict.json, an object of "pinyin": ["gloss", ...], building
+// pinyinTrie from its keys. Every pinyin is weighted by its most frequent
+// gloss in words, so that partial pinyin can be ranked.
+WordStoreBuilder compilePinyinJson(const marisa::Trie &wordsTrie,
+                                   const WordStore &words,
+                                   const std::string &path,
+                                   marisa::Trie &pinyinTrie,
+                                   JsonStats &stats);
+
+} // namespace fcitx::hallelujah
+
+#endif
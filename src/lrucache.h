@@ -0,0 +1,65 @@
+#ifndef _FCITX5_HALLELUJAH_LRUCACHE_H_
+#define _FCITX5_HALLELUJAH_LRUCACHE_H_
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace fcitx::hallelujah {
+
+// Size-bounded map that evicts the least recently used entry.
+template <typename Key, typename Value>
+class LRUCache {
+public:
+    explicit LRUCache(size_t capacity) : capacity_(capacity) {}
+
+    // Returns nullptr on miss. A hit becomes the most recently used entry.
+    Value *find(const Key &key) {
+        auto iter = map_.find(key);
+        if (iter == map_.end()) {
+            return nullptr;
+        }
+        order_.splice(order_.begin(), order_, iter->second);
+        return &iter->second->second;
+    }
+
+    Value &insert(const Key &key, Value value) {
+        if (auto *existing = find(key)) {
+            *existing = std::move(value);
+            return *existing;
+        }
+        if (capacity_ && map_.size() >= capacity_) {
+            map_.erase(order_.back().first);
+            order_.pop_back();
+        }
+        order_.emplace_front(key, std::move(value));
+        map_.emplace(key, order_.begin());
+        return order_.front().second;
+    }
+
+    void erase(const Key &key) {
+        auto iter = map_.find(key);
+        if (iter != map_.end()) {
+            order_.erase(iter->second);
+            map_.erase(iter);
+        }
+    }
+
+    void clear() {
+        map_.clear();
+        order_.clear();
+    }
+    size_t size() const { return map_.size(); }
+    size_t capacity() const { return capacity_; }
+
+private:
+    size_t capacity_;
+    std::list<std::pair<Key, Value>> order_;
+    std::unordered_map<Key, typename std::list<std::pair<Key, Value>>::iterator>
+        map_;
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
@@ -0,0 +1,60 @@
+#include "statistics.h"
+#include <fmt/format.h>
+
+namespace fcitx::hallelujah {
+
+namespace {
+constexpr const char *stageNames[] = {
+    "total", "completion", "pinyin", "fuzzy", "spell", "comment", "ui",
+};
+static_assert(std::size(stageNames) == static_cast<size_t>(Stage::Count));
+} // namespace
+
+void LatencyHistogram::add(std::chrono::steady_clock::duration duration) {
+    uint64_t us =
+        std::chrono::duration_cast<std::chrono::microseconds>(duration)
+            .count();
+    // Bucket b holds [2^(b-1), 2^b) microseconds, bucket 0 less than 1.
+    size_t bucket = 0;
+    while (bucket < NumBuckets - 1 && us >> bucket) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    totalUs_ += us;
+    maxUs_ = std::max(maxUs_, us);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+    if (!count_) {
+        return 0;
+    }
+    uint64_t target = q * count_;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NumBuckets; ++i) {
+        seen += buckets_[i];
+        if (seen > target) {
+            return std::min(uint64_t(1) << i, maxUs_);
+        }
+    }
+    return maxUs_;
+}
+
+std::string LatencyHistogram::toJson() const {
+    return fmt::format(
+        R"({{"count":{},"mean_us":{},"p50_us":{},"p99_us":{},"max_us":{}}})",
+        count_, count_ ? totalUs_ / count_ : 0, quantile(0.5), quantile(0.99),
+        maxUs_);
+}
+
+std::string Statistics::toJson() const {
+    std::string json = "{";
+    for (size_t i = 0; i < histograms_.size(); ++i) {
+        json += fmt::format(R"({}"{}":{})", i ? "," : "", stageNames[i],
+                            histograms_[i].toJson());
+    }
+    json += "}";
+    return json;
+}
+
+} // namespace fcitx::hallelujah
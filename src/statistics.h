@@ -0,0 +1,83 @@
+#ifndef _FCITX5_HALLELUJAH_STATISTICS_H_
+#define _FCITX5_HALLELUJAH_STATISTICS_H_
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace fcitx::hallelujah {
+
+// Stages of a keystroke. Total covers everything from the key press to the
+// candidate list being handed to the input panel.
+enum class Stage {
+    Total,
+    Completion,
+    Pinyin,
+    Fuzzy,
+    Spell,
+    Comment,
+    UI,
+    Count
+};
+
+// Latency histogram with power-of-two microsecond buckets.
+class LatencyHistogram {
+public:
+    void add(std::chrono::steady_clock::duration duration);
+    uint64_t count() const { return count_; }
+    // Upper bound of the bucket holding the q-quantile, in microseconds.
+    uint64_t quantile(double q) const;
+    std::string toJson() const;
+
+private:
+    static constexpr size_t NumBuckets = 32;
+    std::array<uint64_t, NumBuckets> buckets_{};
+    uint64_t count_ = 0;
+    uint64_t totalUs_ = 0;
+    uint64_t maxUs_ = 0;
+};
+
+class Statistics {
+public:
+    void add(Stage stage, std::chrono::steady_clock::duration duration) {
+        histograms_[static_cast<size_t>(stage)].add(duration);
+    }
+    void reset() { histograms_ = {}; }
+    std::string toJson() const;
+
+private:
+    std::array<LatencyHistogram, static_cast<size_t>(Stage::Count)>
+        histograms_;
+};
+
+#ifdef HALLELUJAH_STATISTICS
+inline constexpr bool StatisticsEnabled = true;
+
+// Adds the lifetime of the timer to a stage.
+class StageTimer {
+public:
+    StageTimer(Statistics &statistics, Stage stage)
+        : statistics_(statistics), stage_(stage),
+          start_(std::chrono::steady_clock::now()) {}
+    ~StageTimer() {
+        statistics_.add(stage_, std::chrono::steady_clock::now() - start_);
+    }
+
+private:
+    Statistics &statistics_;
+    Stage stage_;
+    std::chrono::steady_clock::time_point start_;
+};
+#else
+inline constexpr bool StatisticsEnabled = false;
+
+class StageTimer {
+public:
+    StageTimer(Statistics &, Stage) {}
+};
+#endif
+
+} // namespace fcitx::hallelujah
+
+#endif
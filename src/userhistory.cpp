@@ -0,0 +1,185 @@
+#include "userhistory.h"
+#include "hallelujah.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <system_error>
+
+namespace fcitx::hallelujah {
+
+namespace {
+
+// Factor by which a score decays from one time to a later one.
+double decay(uint64_t from, uint64_t to, double halfLife) {
+    return std::exp2(-static_cast<double>(to - from) / halfLife);
+}
+
+} // namespace
+
+UserHistory::UserHistory(std::filesystem::path path)
+    : path_(std::move(path)), writer_([this]() { run(); }) {}
+
+UserHistory::~UserHistory() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_one();
+    writer_.join();
+}
+
+void UserHistory::load() {
+    std::ifstream in(path_);
+    std::string line;
+    while (std::getline(in, line)) {
+        auto second = line.rfind('\t');
+        auto first =
+            second == std::string::npos ? second : line.rfind('\t', second - 1);
+        if (first == std::string::npos || first == 0) {
+            continue;
+        }
+        auto score = std::strtod(line.c_str() + first + 1, nullptr);
+        uint64_t time = std::strtoull(line.c_str() + second + 1, nullptr, 10);
+        if (!std::isfinite(score) || score <= 0) {
+            continue;
+        }
+        apply(std::string_view(line).substr(0, first), score, time);
+        time_ = std::max(time_, time);
+        ++logLines_;
+    }
+    HALLELUJAH_DEBUG() << "Loaded " << entries_.size() << " words from "
+                       << path_;
+}
+
+void UserHistory::add(std::string_view word) {
+    if (word.empty() || word.find_first_of("\t\n") != std::string_view::npos) {
+        return;
+    }
+    ++time_;
+    apply(word, 1, time_);
+    ++logLines_;
+    if (logLines_ > 2 * entries_.size() + 1024) {
+        compact();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.append(word).append("\t1\t").append(std::to_string(time_));
+        pending_ += '\n';
+    }
+    condition_.notify_one();
+}
+
+double UserHistory::boost(std::string_view word) const {
+    auto iter = entries_.find(word);
+    if (iter == entries_.end()) {
+        return 1;
+    }
+    return std::exp2(std::min(decayed(iter->second), MaxDoublings));
+}
+
+void UserHistory::complete(std::string_view prefix,
+                           std::vector<std::string_view> &result) const {
+    result.clear();
+    for (auto iter = words_.lower_bound(prefix);
+         iter != words_.end() && iter->compare(0, prefix.size(), prefix) == 0;
+         ++iter) {
+        result.push_back(*iter);
+    }
+}
+
+double UserHistory::decayed(const Entry &entry) const {
+    return entry.score * decay(entry.time, time_, HalfLife);
+}
+
+void UserHistory::apply(std::string_view word, double score, uint64_t time) {
+    auto iter = entries_.find(word);
+    if (iter == entries_.end()) {
+        auto key = std::string_view(*words_.emplace(word).first);
+        entries_.emplace(key, Entry{score, time});
+        return;
+    }
+    // Both scores are brought forward to the later of the two times.
+    auto &entry = iter->second;
+    if (time >= entry.time) {
+        entry.score = entry.score * decay(entry.time, time, HalfLife) + score;
+        entry.time = time;
+    } else {
+        entry.score += score * decay(time, entry.time, HalfLife);
+    }
+}
+
+void UserHistory::compact() {
+    std::string content;
+    for (auto iter = entries_.begin(); iter != entries_.end();) {
+        auto score = decayed(iter->second);
+        if (score < MinScore) {
+            auto word = words_.find(iter->first);
+            iter = entries_.erase(iter);
+            words_.erase(word);
+            continue;
+        }
+        content.append(iter->first).append("\t");
+        content.append(std::to_string(score)).append("\t");
+        content.append(std::to_string(time_)).append("\n");
+        ++iter;
+    }
+    logLines_ = entries_.size();
+    {
+        // The snapshot already has everything that was queued.
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.clear();
+        rewrite_ = std::move(content);
+    }
+    condition_.notify_one();
+}
+
+void UserHistory::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        condition_.wait(lock, [this]() {
+            return stop_ || !pending_.empty() || rewrite_.has_value();
+        });
+        // Let commits that follow shortly after share one write.
+        condition_.wait_for(lock, FlushDelay, [this]() { return stop_; });
+        auto rewrite = std::move(rewrite_);
+        auto pending = std::move(pending_);
+        rewrite_.reset();
+        pending_.clear();
+        auto stop = stop_;
+        lock.unlock();
+
+        std::error_code ec;
+        std::filesystem::create_directories(path_.parent_path(), ec);
+        if (rewrite) {
+            // Replace the log atomically, so that a crash leaves either the
+            // old or the new one.
+            auto temp = path_;
+            temp += ".tmp";
+            std::ofstream out(temp, std::ios::trunc);
+            out << *rewrite;
+            out.close();
+            if (out) {
+                std::filesystem::rename(temp, path_, ec);
+            }
+            if (!out || ec) {
+                HALLELUJAH_ERROR() << "Failed to write " << path_;
+            }
+        }
+        if (!pending.empty()) {
+            std::ofstream out(path_, std::ios::app);
+            out << pending;
+            if (!out) {
+                HALLELUJAH_ERROR() << "Failed to append to " << path_;
+            }
+        }
+
+        lock.lock();
+        if (stop && pending_.empty() && !rewrite_) {
+            return;
+        }
+    }
+}
+
+} // namespace fcitx::hallelujah
@@ -0,0 +1,89 @@
+#ifndef _FCITX5_HALLELUJAH_USERHISTORY_H_
+#define _FCITX5_HALLELUJAH_USERHISTORY_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace fcitx::hallelujah {
+
+// Words committed by the user, each with a score that halves every
+// HalfLife commits. Time is counted in commits rather than seconds, so
+// the history does not fade while the input method is not used.
+//
+// The history is persisted as an append-only log of "word\tscore\ttime"
+// lines. A line adds its score, decayed from its time, to the word.
+// Appends are batched and written by a background thread. Once the log
+// has grown well past the number of words, it is rewritten with one line
+// per word.
+class UserHistory {
+public:
+    explicit UserHistory(std::filesystem::path path);
+    UserHistory(const UserHistory &) = delete;
+    UserHistory &operator=(const UserHistory &) = delete;
+    // Writes out whatever is still queued.
+    ~UserHistory();
+
+    // Reads the log. Must finish before any other call.
+    void load();
+    void add(std::string_view word);
+    // Factor applied to the frequency of word, at least 1. Every recent
+    // commit of the word counts as doubling its frequency.
+    double boost(std::string_view word) const;
+    // Replaces result with the words of the history starting with prefix,
+    // in lexicographic order. Takes time linear in their number, which is
+    // only bounded by compaction: a word committed once is dropped after
+    // about seven half-lives, so the history holds roughly the distinct
+    // words of the last few thousand commits.
+    void complete(std::string_view prefix,
+                  std::vector<std::string_view> &result) const;
+    size_t size() const { return entries_.size(); }
+    // Number of commits so far.
+    uint64_t time() const { return time_; }
+
+private:
+    struct Entry {
+        double score = 0;
+        uint64_t time = 0;
+    };
+
+    double decayed(const Entry &entry) const;
+    void apply(std::string_view word, double score, uint64_t time);
+    void compact();
+    void run();
+
+    static constexpr double HalfLife = 1000;
+    static constexpr double MaxDoublings = 16;
+    // Words that decayed below this are dropped by compaction.
+    static constexpr double MinScore = 0.01;
+    static constexpr auto FlushDelay = std::chrono::seconds(5);
+
+    std::filesystem::path path_;
+    // Owns the words. Entries are keyed by views of them, so that lookups
+    // do not need to build a string.
+    std::set<std::string, std::less<>> words_;
+    std::unordered_map<std::string_view, Entry> entries_;
+    uint64_t time_ = 0;
+    size_t logLines_ = 0;
+
+    // Shared with the writer thread.
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::string pending_;
+    std::optional<std::string> rewrite_;
+    bool stop_ = false;
+    std::thread writer_;
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
@@ -0,0 +1,235 @@
+#include "wordstore.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <zstd.h>
+
+namespace fcitx::hallelujah {
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)) {}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+    if (this != &other) {
+        close();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() { close(); }
+
+void MappedFile::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat " + path);
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw std::runtime_error("Failed to map " + path);
+    }
+    data_ = static_cast<const char *>(data);
+    size_ = st.st_size;
+}
+
+void MappedFile::close() {
+    if (data_) {
+        munmap(const_cast<char *>(data_), size_);
+        data_ = nullptr;
+        size_ = 0;
+    }
+}
+
+void MappedFile::adviseRandom() const {
+    if (data_) {
+        madvise(const_cast<char *>(data_), size_, MADV_RANDOM);
+    }
+}
+
+struct WordStore::Decoder {
+    Decoder(const char *dictionary, size_t size)
+        : context(ZSTD_createDCtx()),
+          dictionary(size ? ZSTD_createDDict(dictionary, size) : nullptr) {
+        if (!context || (size && !this->dictionary)) {
+            throw std::runtime_error("Invalid zstd dictionary");
+        }
+    }
+    ~Decoder() {
+        ZSTD_freeDDict(dictionary);
+        ZSTD_freeDCtx(context);
+    }
+    Decoder(const Decoder &) = delete;
+    Decoder &operator=(const Decoder &) = delete;
+
+    ZSTD_DCtx *context;
+    ZSTD_DDict *dictionary;
+};
+
+WordStore::WordStore() = default;
+
+WordStore::~WordStore() = default;
+
+void WordStore::load(const std::string &path) {
+    MappedFile file;
+    file.open(path);
+    attach(file.data(), file.size(), path);
+    // Only the blocks on display are read.
+    file.adviseRandom();
+    file_ = std::move(file);
+    image_.clear();
+}
+
+void WordStore::assign(std::string image) {
+    // Moving a string may move its buffer, so it is attached once in place.
+    image_ = std::move(image);
+    file_.close();
+    try {
+        attach(image_.data(), image_.size(), "words.bin image");
+    } catch (...) {
+        image_.clear();
+        header_ = nullptr;
+        throw;
+    }
+}
+
+size_t WordStore::heapSize() const {
+    size_t size = image_.capacity();
+    if (decoder_) {
+        size += ZSTD_sizeof_DCtx(decoder_->context) +
+                ZSTD_sizeof_DDict(decoder_->dictionary);
+    }
+    return size;
+}
+
+void WordStore::attach(const char *data, size_t size,
+                       const std::string &name) {
+    auto fail = [&name]() { throw std::runtime_error("Invalid " + name); };
+    if (size < sizeof(format::WordFileHeader)) {
+        fail();
+    }
+    const auto *header =
+        reinterpret_cast<const format::WordFileHeader *>(data);
+    if (std::memcmp(header->magic, format::WordMagic,
+                    sizeof(format::WordMagic)) != 0 ||
+        header->version != format::WordVersion ||
+        header->blockRecords == 0) {
+        fail();
+    }
+    auto inside = [size](uint64_t offset, uint64_t length) {
+        return offset <= size && length <= size - offset;
+    };
+    uint64_t numBlocks =
+        (uint64_t(header->numRecords) + header->blockRecords - 1) /
+        header->blockRecords;
+    if (!inside(header->frequenciesOffset,
+                uint64_t(header->numRecords) * sizeof(double)) ||
+        !inside(header->blocksOffset, (numBlocks + 1) * sizeof(uint64_t)) ||
+        !inside(header->dictionaryOffset, header->dictionarySize) ||
+        !inside(header->payloadsOffset, header->payloadsSize) ||
+        header->frequenciesOffset % alignof(double) ||
+        header->blocksOffset % alignof(uint64_t)) {
+        fail();
+    }
+    // The blocks themselves are only checked once decoded.
+    const auto *blocks =
+        reinterpret_cast<const uint64_t *>(data + header->blocksOffset);
+    for (uint64_t i = 0; i < numBlocks; ++i) {
+        if (blocks[i] > blocks[i + 1]) {
+            fail();
+        }
+    }
+    if (blocks[0] != 0 || blocks[numBlocks] != header->payloadsSize) {
+        fail();
+    }
+
+    decoder_ = std::make_unique<Decoder>(data + header->dictionaryOffset,
+                                         header->dictionarySize);
+    cache_.clear();
+    header_ = header;
+    frequencies_ =
+        reinterpret_cast<const double *>(data + header->frequenciesOffset);
+    blocks_ = blocks;
+    payloads_ = data + header->payloadsOffset;
+}
+
+const WordStore::Block *WordStore::decode(uint32_t id) const {
+    if (!contains(id)) {
+        return nullptr;
+    }
+    uint32_t index = id / header_->blockRecords;
+    if (const auto *block = cache_.find(index)) {
+        return block;
+    }
+    // Filled in place, so that the views into data are never moved.
+    auto &block = cache_.insert(index, Block{});
+    uint32_t numRecords =
+        std::min(header_->blockRecords,
+                 header_->numRecords - index * header_->blockRecords);
+    const char *frame = payloads_ + blocks_[index];
+    size_t frameSize = blocks_[index + 1] - blocks_[index];
+    auto size = ZSTD_getFrameContentSize(frame, frameSize);
+    bool valid = size != ZSTD_CONTENTSIZE_ERROR &&
+                 size != ZSTD_CONTENTSIZE_UNKNOWN &&
+                 size <= MaxBlockSize;
+    if (valid) {
+        block.data.resize(size);
+        size = ZSTD_decompress_usingDDict(decoder_->context,
+                                          block.data.data(), size, frame,
+                                          frameSize, decoder_->dictionary);
+        valid = !ZSTD_isError(size) && size == block.data.size();
+    }
+    std::string_view rest = block.data;
+    auto read = [&rest, &valid](uint32_t &value) {
+        if (rest.size() < sizeof(value)) {
+            valid = false;
+            return;
+        }
+        std::memcpy(&value, rest.data(), sizeof(value));
+        rest.remove_prefix(sizeof(value));
+    };
+    auto readString = [&]() {
+        uint32_t length = 0;
+        read(length);
+        if (!valid || rest.size() < length) {
+            valid = false;
+            return;
+        }
+        block.strings.push_back(rest.substr(0, length));
+        rest.remove_prefix(length);
+    };
+    for (uint32_t i = 0; valid && i < numRecords; ++i) {
+        block.first.push_back(block.strings.size());
+        readString();
+        uint32_t count = 0;
+        read(count);
+        for (uint32_t j = 0; valid && j < count; ++j) {
+            readString();
+        }
+    }
+    if (!valid) {
+        // Corrupt payloads only lose the comments of their words.
+        block.strings.assign(numRecords, std::string_view());
+        block.first.clear();
+        for (uint32_t i = 0; i < numRecords; ++i) {
+            block.first.push_back(i);
+        }
+    }
+    block.first.push_back(block.strings.size());
+    return &block;
+}
+
+} // namespace fcitx::hallelujah
@@ -0,0 +1,115 @@
+#ifndef _FCITX5_HALLELUJAH_WORDSTORE_H_
+#define _FCITX5_HALLELUJAH_WORDSTORE_H_
+
+#include "dictformat.h"
+#include "lrucache.h"
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fcitx::hallelujah {
+
+// Read-only shared mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+    ~MappedFile();
+
+    // Throws std::runtime_error on failure.
+    void open(const std::string &path);
+    void close();
+    // Tells the kernel not to read ahead, so that only the pages actually
+    // looked at become resident.
+    void adviseRandom() const;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Word metadata (frequency, IPA, translations) indexed by trie key ID,
+// served out of a mapped words.bin. The payloads are decompressed a block
+// at a time when first looked at, and the last few blocks are kept. The
+// views returned stay valid until BlockCacheSize other blocks have been
+// looked at, and the cache is not synchronized, so payloads must only be
+// looked at from one thread at a time.
+class WordStore {
+public:
+    static constexpr size_t BlockCacheSize = 64;
+
+    WordStore();
+    ~WordStore();
+
+    // Throws std::runtime_error if the file is missing or malformed.
+    void load(const std::string &path);
+    // Serves the words.bin content held by image instead. Throws
+    // std::runtime_error if it is malformed.
+    void assign(std::string image);
+
+    uint32_t size() const { return header_ ? header_->numRecords : 0; }
+    bool contains(uint32_t id) const { return id < size(); }
+    double frequency(uint32_t id) const {
+        return contains(id) ? frequencies_[id] : 0;
+    }
+    std::string_view ipa(uint32_t id) const {
+        const auto *block = decode(id);
+        return block ? block->strings[block->first[offset(id)]]
+                     : std::string_view();
+    }
+    uint32_t translationCount(uint32_t id) const {
+        const auto *block = decode(id);
+        return block ? block->first[offset(id) + 1] -
+                           block->first[offset(id)] - 1
+                     : 0;
+    }
+    std::string_view translation(uint32_t id, uint32_t index) const {
+        const auto *block = decode(id);
+        return block->strings[block->first[offset(id)] + 1 + index];
+    }
+    size_t mappedSize() const { return file_.size(); }
+    // The image and the decompressor, but not the blocks it holds.
+    size_t heapSize() const;
+
+private:
+    struct Block {
+        std::string data;
+        // The IPA of each record, followed by its translations.
+        std::vector<std::string_view> strings;
+        // Index in strings of the IPA of each record, and the size of
+        // strings.
+        std::vector<uint32_t> first;
+    };
+    struct Decoder;
+
+    // Larger blocks are taken to be corrupt.
+    static constexpr size_t MaxBlockSize = 16 << 20;
+
+    // Points the accessors at data after checking it.
+    void attach(const char *data, size_t size, const std::string &name);
+    uint32_t offset(uint32_t id) const { return id % header_->blockRecords; }
+    // Null if id is out of range. A block that fails to decode holds no
+    // payloads.
+    const Block *decode(uint32_t id) const;
+
+    MappedFile file_;
+    std::string image_;
+    const format::WordFileHeader *header_ = nullptr;
+    const double *frequencies_ = nullptr;
+    const uint64_t *blocks_ = nullptr;
+    const char *payloads_ = nullptr;
+    std::unique_ptr<Decoder> decoder_;
+    mutable LRUCache<uint32_t, Block> cache_{BlockCacheSize};
+};
+
+} // namespace fcitx::hallelujah
+
+#endif
@@ -0,0 +1,370 @@
+#include "hallelujah_public.h"
+#include "testfrontend_public.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcitx-config/rawconfig.h>
+#include <fcitx-utils/eventdispatcher.h>
+#include <fcitx-utils/log.h>
+#include <fcitx/addonmanager.h>
+#include <fcitx/inputmethodmanager.h>
+#include <fcitx/instance.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <system_error>
+#include <tuple>
+#include <vector>
+
+using namespace fcitx;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Heap allocations made by this thread, which is the one handling keys.
+thread_local uint64_t allocations = 0;
+
+} // namespace
+
+void *operator new(std::size_t size) {
+    ++allocations;
+    if (auto *ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace {
+
+struct Options {
+    std::string wordList = HALLELUJAH_WORD_LIST;
+    std::string output;
+    size_t words = 20000;
+    unsigned seed = 1;
+    // Fail if the keys allocate more than this on average.
+    double maxAllocsPerKey = -1;
+    // Overrides LatencyBudget if not negative.
+    int latencyBudget = -1;
+};
+
+// Peak and current resident set size in KiB, from /proc/self/status.
+std::pair<long, long> residentSize() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    long peak = 0;
+    long current = 0;
+    while (std::getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0) {
+            peak = std::atol(line.c_str() + 6);
+        } else if (line.rfind("VmRSS:", 0) == 0) {
+            current = std::atol(line.c_str() + 6);
+        }
+    }
+    return {peak, current};
+}
+
+// Words of the list drawn by frequency, restricted to what can be typed
+// letter by letter.
+std::vector<std::string> makeTrace(const Options &options) {
+    std::ifstream ifs(options.wordList);
+    FCITX_ASSERT(ifs) << "Failed to open " << options.wordList;
+    std::vector<std::string> words;
+    std::vector<double> weights;
+    std::string word;
+    double count;
+    while (ifs >> word >> count) {
+        if (std::all_of(word.begin(), word.end(),
+                        [](char c) { return c >= 'a' && c <= 'z'; })) {
+            words.push_back(word);
+            weights.push_back(count);
+        }
+    }
+    std::mt19937 rng(options.seed);
+    std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+    std::vector<std::string> trace;
+    trace.reserve(options.words);
+    for (size_t i = 0; i < options.words; ++i) {
+        trace.push_back(words[pick(rng)]);
+    }
+    return trace;
+}
+
+class Recorder {
+public:
+    void add(const std::string &category, double sample) {
+        samples_[category].push_back(sample);
+    }
+
+    double mean() const {
+        double total = 0;
+        size_t count = 0;
+        for (const auto &[category, samples] : samples_) {
+            for (auto sample : samples) {
+                total += sample;
+            }
+            count += samples.size();
+        }
+        return count ? total / count : 0;
+    }
+
+    void write(std::ostream &out, const char *name) const {
+        out << "\"" << name << "\":{";
+        bool first = true;
+        for (auto [category, samples] : samples_) {
+            std::sort(samples.begin(), samples.end());
+            auto at = [&samples](double q) {
+                return samples[std::min<size_t>(samples.size() - 1,
+                                                q * samples.size())];
+            };
+            out << (first ? "" : ",") << "\"" << category << "\":{"
+                << "\"count\":" << samples.size() << ",\"p50\":" << at(0.5)
+                << ",\"p99\":" << at(0.99) << ",\"max\":" << samples.back()
+                << "}";
+            first = false;
+        }
+        out << "}";
+    }
+
+private:
+    std::map<std::string, std::vector<double>> samples_;
+};
+
+// One key of the trace, with the text it is expected to commit if any.
+struct Press {
+    std::string key;
+    const char *category;
+    std::string commit;
+};
+
+// Every word is typed letter by letter, with an occasional typo fixed by
+// BackSpace. It is committed by one of the keys that commit the typed text
+// itself, so the expectation does not depend on ranking.
+std::vector<Press> makePresses(const Options &options) {
+    std::mt19937 rng(options.seed);
+    static const char *const commitKeys[] = {"1", "space", "Return"};
+    std::vector<Press> presses;
+    for (const auto &word : makeTrace(options)) {
+        for (char c : word) {
+            if (rng() % 20 == 0) {
+                presses.push_back(
+                    {std::string(1, 'a' + rng() % 26), "typing", ""});
+                presses.push_back({"BackSpace", "backspace", ""});
+            }
+            presses.push_back({std::string(1, c), "typing", ""});
+        }
+        std::string commitKey = commitKeys[rng() % 3];
+        auto commit = commitKey == "space" ? word + " " : word;
+        presses.push_back({commitKey, "selection", commit});
+    }
+    return presses;
+}
+
+// Replays the trace one key per event loop iteration, so that the work an
+// input context defers to the event loop runs between keys as it would
+// with a user typing. A key is timed until the next iteration starts.
+class Replay {
+public:
+    Replay(Instance *instance, EventDispatcher *dispatcher,
+           const Options &options, std::ostream &out,
+           std::function<void(bool)> done)
+        : instance_(instance), dispatcher_(dispatcher), options_(options),
+          out_(out), done_(std::move(done)) {}
+
+    void start() {
+        start_ = Clock::now();
+        hallelujah_ = instance_->addonManager().addon("hallelujah", true);
+        FCITX_ASSERT(hallelujah_);
+        created_ = Clock::now();
+        FCITX_ASSERT(hallelujah_->call<IHallelujahEngine::waitForDictionary>());
+        loaded_ = Clock::now();
+        std::tie(loadPeak_, loadCurrent_) = residentSize();
+        // Learning would make every run depend on the ones before it.
+        RawConfig config;
+        config.setValueByPath("UserHistory", "False");
+        if (options_.latencyBudget >= 0) {
+            config.setValueByPath("LatencyBudget",
+                                  std::to_string(options_.latencyBudget));
+        }
+        hallelujah_->setConfig(config);
+
+        auto defaultGroup = instance_->inputMethodManager().currentGroup();
+        defaultGroup.inputMethodList().clear();
+        defaultGroup.inputMethodList().push_back(
+            InputMethodGroupItem("hallelujah"));
+        defaultGroup.setDefaultInputMethod("");
+        instance_->inputMethodManager().setGroup(defaultGroup);
+        testfrontend_ = instance_->addonManager().addon("testfrontend");
+        uuid_ = testfrontend_->call<ITestFrontend::createInputContext>(
+            "benchmarkhallelujah");
+        presses_ = makePresses(options_);
+        words_ = std::count_if(
+            presses_.begin(), presses_.end(),
+            [](const Press &press) { return !press.commit.empty(); });
+        dispatcher_->schedule([this]() { step(); });
+    }
+
+private:
+    void step() {
+        auto now = Clock::now();
+        if (next_ > 0) {
+            const auto &press = presses_[next_ - 1];
+            allocation_.add(press.category, allocations - allocated_);
+            latency_.add(press.category,
+                         std::chrono::duration<double, std::micro>(
+                             now - begin_)
+                             .count());
+        }
+        if (next_ == presses_.size()) {
+            return done_(finish());
+        }
+        const auto &press = presses_[next_++];
+        if (!press.commit.empty()) {
+            testfrontend_->call<ITestFrontend::pushCommitExpectation>(
+                press.commit);
+        }
+        Key key(press.key);
+        allocated_ = allocations;
+        begin_ = Clock::now();
+        testfrontend_->call<ITestFrontend::keyEvent>(uuid_, key, false);
+        dispatcher_->schedule([this]() { step(); });
+    }
+
+    // Returns false if a limit of the options was exceeded.
+    bool finish() {
+        auto [peak, current] = residentSize();
+        auto ms = [](Clock::duration duration) {
+            return std::chrono::duration<double, std::milli>(duration)
+                .count();
+        };
+        out_ << "{\"words\":" << words_ << ",\"seed\":" << options_.seed
+             << ",\"addon_create_ms\":" << ms(created_ - start_)
+             << ",\"dictionary_load_ms\":" << ms(loaded_ - start_)
+             << ",\"rss_after_load_kb\":" << loadCurrent_
+             << ",\"peak_rss_after_load_kb\":" << loadPeak_
+             << ",\"rss_kb\":" << current << ",\"peak_rss_kb\":" << peak
+             << ",";
+        latency_.write(out_, "latency_us");
+        out_ << ",";
+        allocation_.write(out_, "allocations");
+        out_ << ",\"mean_allocations\":" << allocation_.mean()
+             << ",\"engine\":"
+             << hallelujah_->call<IHallelujahEngine::statistics>() << "}"
+             << std::endl;
+        if (options_.maxAllocsPerKey >= 0 &&
+            allocation_.mean() > options_.maxAllocsPerKey) {
+            std::cerr << "Keys allocated " << allocation_.mean()
+                      << " times on average, more than "
+                      << options_.maxAllocsPerKey << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    Instance *instance_;
+    EventDispatcher *dispatcher_;
+    const Options &options_;
+    std::ostream &out_;
+    std::function<void(bool)> done_;
+    AddonInstance *hallelujah_ = nullptr;
+    AddonInstance *testfrontend_ = nullptr;
+    ICUUID uuid_;
+    std::vector<Press> presses_;
+    size_t words_ = 0;
+    size_t next_ = 0;
+    Clock::time_point start_, created_, loaded_, begin_;
+    long loadPeak_ = 0;
+    long loadCurrent_ = 0;
+    uint64_t allocated_ = 0;
+    Recorder latency_;
+    Recorder allocation_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    Options options;
+    auto usage = [argv]() {
+        std::cerr << "Usage: " << argv[0]
+                  << " [--words N] [--seed N] [--word-list FILE]"
+                     " [--output FILE] [--max-allocs-per-key N]"
+                     " [--latency-budget MS]"
+                  << std::endl;
+        return 1;
+    };
+    for (int i = 1; i < argc; i += 2) {
+        std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            return usage();
+        }
+        if (arg == "--words") {
+            options.words = std::strtoul(argv[i + 1], nullptr, 10);
+        } else if (arg == "--seed") {
+            options.seed = std::strtoul(argv[i + 1], nullptr, 10);
+        } else if (arg == "--word-list") {
+            options.wordList = argv[i + 1];
+        } else if (arg == "--output") {
+            options.output = argv[i + 1];
+        } else if (arg == "--max-allocs-per-key") {
+            options.maxAllocsPerKey = std::strtod(argv[i + 1], nullptr);
+        } else if (arg == "--latency-budget") {
+            options.latencyBudget = std::atoi(argv[i + 1]);
+        } else {
+            return usage();
+        }
+    }
+
+    // Keep the saved configuration, the history and any user word lists of
+    // whoever runs the benchmark out of it, in both directions.
+    char home[] = "/tmp/benchmarkhallelujah-XXXXXX";
+    if (!mkdtemp(home)) {
+        std::cerr << "Failed to create a temporary directory" << std::endl;
+        return 1;
+    }
+    setenv("XDG_CONFIG_HOME", (std::string(home) + "/config").c_str(), 1);
+    setenv("XDG_DATA_HOME", (std::string(home) + "/data").c_str(), 1);
+    // Declared before the instance so that it goes after anything the
+    // instance saves on its way out.
+    std::unique_ptr<char, void (*)(char *)> cleanup(home, [](char *path) {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    });
+
+    char arg0[] = "benchmarkhallelujah";
+    char arg1[] = "--disable=all";
+    char arg2[] = "--enable=testim,testfrontend,spell,hallelujah";
+    char *instanceArgv[] = {arg0, arg1, arg2};
+    fcitx::Log::setLogRule("default=3,hallelujah=3");
+    Instance instance(FCITX_ARRAY_SIZE(instanceArgv), instanceArgv);
+    instance.addonManager().registerDefaultLoader(nullptr);
+    EventDispatcher dispatcher;
+    dispatcher.attach(&instance.eventLoop());
+    std::ofstream file;
+    if (!options.output.empty()) {
+        file.open(options.output);
+    }
+    bool passed = false;
+    Replay replay(&instance, &dispatcher, options,
+                  options.output.empty() ? std::cout : file,
+                  [&dispatcher, &instance, &passed](bool result) {
+                      passed = result;
+                      instance.deactivate();
+                      dispatcher.schedule([&dispatcher, &instance]() {
+                          dispatcher.detach();
+                          instance.exit();
+                      });
+                  });
+    dispatcher.schedule([&replay]() { replay.start(); });
+    instance.exec();
+    return passed ? 0 : 1;
+}
@@ -1,52 +1,172 @@
+#include "hallelujah_public.h"
 #include "testfrontend_public.h"
+#include <fcitx-config/rawconfig.h>
 #include <fcitx-utils/eventdispatcher.h>
 #include <fcitx-utils/log.h>
+#include <fcitx-utils/standardpaths.h>
 #include <fcitx/addonmanager.h>
 #include <fcitx/inputmethodmanager.h>
 #include <fcitx/instance.h>
+#include <filesystem>
+#include <fstream>
 
 using namespace fcitx;
 
-std::vector<std::pair<std::vector<std::string>, std::vector<std::string>>>
-    expectedCommit{
-        {{"a", "4"}, {"at"}}, // a: exact match; and are at: frequency order.
-        {{"a", "space"}, {"a "}},
-        {{"a", "Return"}, {"a"}},
-        {{"a", "Down", "space"}, {"and "}},
-        {{"a", "Up", "Return"}, {"also"}},
-        {{"a", "Right", "b", "Left", "Left", "c", "Return"}, {"bac"}},
-        {{"a", "Escape"}, {}},
-        {{"a", "b", "BackSpace", "Return"}, {"a"}},
-        {{"a", "b", "c", "Home", "Delete", "End", "d", "Return"}, {"bcd"}},
-        {{"a", "X", "e", "Return"}, {"aXe"}},
-        {{"a", ","}, {"a"}}, // comma is passed to client
-        {{"s", "h", "u", "r", "u", "f", "a", "3"}, {"input method"}},
-        {{"e", "x", "c", "i", "t", "n", "g", "2"}, {"exciting"}}, // spell check
-    };
+using Expectations =
+    std::vector<std::pair<std::vector<std::string>, std::vector<std::string>>>;
+
+Expectations expectedCommit{
+    {{"a", "4"}, {"at"}}, // a: exact match; and are at: frequency order.
+    {{"a", "space"}, {"a "}},
+    {{"a", "Return"}, {"a"}},
+    {{"a", "Down", "space"}, {"and "}},
+    {{"a", "Up", "Return"}, {"also"}},
+    {{"a", "Page_Down", "Page_Up", "4"}, {"at"}},
+    {{"a", "Right", "b", "Left", "Left", "c", "Return"}, {"bac"}},
+    {{"a", "Escape"}, {}},
+    {{"a", "b", "BackSpace", "Return"}, {"a"}},
+    {{"a", "b", "c", "Home", "Delete", "End", "d", "Return"}, {"bcd"}},
+    {{"a", "X", "e", "Return"}, {"aXe"}},
+    {{"a", ","}, {"a"}}, // comma is passed to client
+    {{"s", "h", "u", "r", "u", "f", "a", "3"}, {"input method"}},
+    {{"e", "x", "c", "i", "t", "n", "g", "2"}, {"exciting"}}, // insertion
+    {{"b", "e", "c", "u", "a", "s", "e", "2"}, {"because"}}, // transpose
+#ifdef HALLELUJAH_TEST_DATA
+    // After "have": a, fun. The number keys stay with the application
+    // until Tab selects into the predictions.
+    {{"h", "a", "v", "e", "1", "3"}, {"have"}},
+    {{"h", "a", "v", "e", "1", "Tab", "2"}, {"have", " fun"}},
+    {{"h", "a", "v", "e", "space", "Tab", "Return"}, {"have ", "a"}},
+    {{"h", "a", "v", "e", "1", "Tab", "Escape", "x", "Return"},
+     {"have", "x"}},
+#endif
+};
+
+// zy: zyban, zyrtec, zyxel in frequency order. The user word list adds
+// zyqwerty and lists zyrtec as more frequent, which only shows once.
+Expectations expectedWordList{
+    {{"z", "y", "2"}, {"zyrtec"}},
+    {{"z", "y", "3"}, {"zyban"}},
+    {{"z", "y", "4"}, {"zyqwerty"}},
+    {{"z", "y", "5"}, {"zyxel"}},
+};
+
+// Once zyzzyx is added to the word list.
+Expectations expectedReload{
+    {{"z", "y", "2"}, {"zyzzyx"}},
+    {{"z", "y", "3"}, {"zyrtec"}},
+};
+
+// qx: qxl, qxw, qxp, qxk. Three commits make qxk eight times as frequent.
+Expectations expectedHistory{
+    {{"q", "x", "2"}, {"qxl"}},
+    {{"q", "x", "k", "1"}, {"qxk"}},
+    {{"q", "x", "k", "1"}, {"qxk"}},
+    {{"q", "x", "k", "1"}, {"qxk"}},
+    {{"q", "x", "2"}, {"qxk"}},
+};
+
+// The language xx has the English dictionary, but a word list of its own.
+Expectations expectedLanguage{
+    {{"z", "y", "2"}, {"zyxx"}},
+    {{"z", "y", "3"}, {"zyban"}},
+};
+
+std::filesystem::path userWordList() {
+    return StandardPaths::global().userDirectory(StandardPathsType::PkgData) /
+           "hallelujah/words/test.txt";
+}
+
+void writeFile(const std::filesystem::path &path, const std::string &content,
+               std::ios::openmode mode = std::ios::trunc) {
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream out(path, std::ios::out | mode);
+    out << content;
+    FCITX_ASSERT(out);
+}
+
+// Fixtures under XDG_DATA_HOME, written afresh on every run.
+void writeFixtures() {
+    auto pkgData =
+        StandardPaths::global().userDirectory(StandardPathsType::PkgData);
+    std::filesystem::remove(pkgData / "hallelujah/history");
+    writeFile(userWordList(), "# Words of the team\n"
+                              "zyrtec 5000000\n"
+                              "zyqwerty 1000000\n");
+    writeFile(pkgData / "hallelujah/xx/words/test.txt", "zyxx 1e12\n");
+    writeFile(pkgData / "inputmethod/hallelujah-xx.conf",
+              "[InputMethod]\n"
+              "Name=Hallelujah (Test)\n"
+              "Label=h\n"
+              "LangCode=en\n"
+              "Addon=hallelujah\n");
+}
 
 void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
     dispatcher->schedule([dispatcher, instance]() {
         auto *hallelujah = instance->addonManager().addon("hallelujah", true);
         FCITX_ASSERT(hallelujah);
-        auto defaultGroup = instance->inputMethodManager().currentGroup();
-        defaultGroup.inputMethodList().clear();
-        defaultGroup.inputMethodList().push_back(
-            InputMethodGroupItem("hallelujah"));
-        defaultGroup.setDefaultInputMethod("");
-        instance->inputMethodManager().setGroup(defaultGroup);
+        FCITX_ASSERT(
+            hallelujah->call<IHallelujahEngine::waitForDictionary>());
+        // Keep the ranking independent of what earlier runs committed or
+        // left configured.
+        RawConfig config;
+        config.setValueByPath("UserHistory", "False");
+        config.setValueByPath("Language", "en");
+        hallelujah->setConfig(config);
         auto *testfrontend = instance->addonManager().addon("testfrontend");
-        auto uuid =
-            testfrontend->call<ITestFrontend::createInputContext>("testapp");
-        for (const auto &data : expectedCommit) {
-            for (const auto &expect : data.second) {
-                testfrontend->call<ITestFrontend::pushCommitExpectation>(
-                    expect);
-            }
-            for (const auto &key : data.first) {
-                testfrontend->call<ITestFrontend::keyEvent>(uuid, Key(key),
-                                                            false);
+        // A new input context types with the only input method of the
+        // group.
+        auto createInputContext = [instance,
+                                   testfrontend](const std::string &name) {
+            auto group = instance->inputMethodManager().currentGroup();
+            group.inputMethodList().clear();
+            group.inputMethodList().push_back(InputMethodGroupItem(name));
+            group.setDefaultInputMethod("");
+            instance->inputMethodManager().setGroup(group);
+            return testfrontend->call<ITestFrontend::createInputContext>(
+                "testapp");
+        };
+        auto type = [testfrontend](const ICUUID &uuid,
+                                   const Expectations &expectations) {
+            for (const auto &data : expectations) {
+                for (const auto &expect : data.second) {
+                    testfrontend->call<ITestFrontend::pushCommitExpectation>(
+                        expect);
+                }
+                for (const auto &key : data.first) {
+                    testfrontend->call<ITestFrontend::keyEvent>(uuid, Key(key),
+                                                                false);
+                }
             }
-        }
+        };
+        auto uuid = createInputContext("hallelujah");
+        type(uuid, expectedCommit);
+        type(uuid, expectedWordList);
+
+        // Picked up without restarting, like a configuration change.
+        writeFile(userWordList(), "zyzzyx 10000000\n", std::ios::app);
+        instance->reloadAddonConfig("hallelujah");
+        FCITX_ASSERT(
+            hallelujah->call<IHallelujahEngine::waitForDictionary>());
+        type(uuid, expectedReload);
+
+        config.setValueByPath("UserHistory", "True");
+        hallelujah->setConfig(config);
+        type(uuid, expectedHistory);
+
+#ifdef HALLELUJAH_TEST_DATA
+        // Loaded through the Language setting, then typed in through its
+        // own entry while the plain one is back to English.
+        config.setValueByPath("Language", "xx");
+        hallelujah->setConfig(config);
+        FCITX_ASSERT(
+            hallelujah->call<IHallelujahEngine::waitForDictionary>());
+        config.setValueByPath("Language", "en");
+        hallelujah->setConfig(config);
+        type(createInputContext("hallelujah-xx"), expectedLanguage);
+        type(createInputContext("hallelujah"), expectedReload);
+#endif
         instance->deactivate();
         dispatcher->schedule([dispatcher, instance]() {
             dispatcher->detach();
@@ -56,6 +176,7 @@ void scheduleEvent(EventDispatcher *dispatcher, Instance *instance) {
 }
 
 int main() {
+    writeFixtures();
     char arg0[] = "testhallelujah";
     char arg1[] = "--disable=all";
     char arg2[] = "--enable=testim,testfrontend,spell,hallelujah";
@@ -0,0 +1,454 @@
+// Build-time compiler for the binary dictionary files read by the addon.
+#include "completion.h"
+#include "dictformat.h"
+#include "jsondict.h"
+#include "wordstore.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <marisa/trie.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace format = fcitx::hallelujah::format;
+using fcitx::hallelujah::CompletionIndex;
+using fcitx::hallelujah::compilePinyinJson;
+using fcitx::hallelujah::compileWordsJson;
+using fcitx::hallelujah::JsonStats;
+using fcitx::hallelujah::readWordCounts;
+using fcitx::hallelujah::WordStore;
+
+namespace {
+
+template <typename T>
+void writeArray(std::ostream &out, const std::vector<T> &v) {
+    out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+// Problems found in the sources. Errors fail the build, warnings only
+// lose the entries concerned.
+class Report {
+public:
+    void error(const std::string &message) {
+        print(message, errors_);
+        ++errors_;
+    }
+    void warnings(const std::string &what, size_t count) {
+        if (count) {
+            std::cerr << "warning: " << count << " " << what << std::endl;
+            warnings_ += count;
+        }
+    }
+    size_t errors() const { return errors_; }
+    size_t warnings() const { return warnings_; }
+
+private:
+    // Past the first few, only the count is kept.
+    static constexpr size_t MaxPrinted = 20;
+
+    static void print(const std::string &message, size_t printed) {
+        if (printed < MaxPrinted) {
+            std::cerr << "error: " << message << std::endl;
+        } else if (printed == MaxPrinted) {
+            std::cerr << "error: further errors omitted" << std::endl;
+        }
+    }
+
+    size_t errors_ = 0;
+    size_t warnings_ = 0;
+};
+
+class Timer {
+public:
+    double seconds() const {
+        return std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start_)
+            .count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_ =
+        std::chrono::steady_clock::now();
+};
+
+void writeFile(const std::string &path, const std::string &data) {
+    std::ofstream out(path, std::ios::binary);
+    out.write(data.data(), data.size());
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+void printSize(const std::string &path, const std::string &what,
+               double seconds) {
+    std::cout << path << ": " << what << ", "
+              << std::filesystem::file_size(path) << " bytes in " << seconds
+              << " s" << std::endl;
+}
+
+void printStats(const char *input, const JsonStats &stats) {
+    std::cout << input << ": parsed " << stats.entries << " entries in "
+              << stats.seconds << " s, peak RSS " << stats.peakRssKb << " KiB"
+              << std::endl;
+}
+
+int compileWords(const char *triePath, const char *wordsPath,
+                 const char *output) {
+    marisa::Trie trie;
+    trie.load(triePath);
+    JsonStats stats;
+    auto builder = compileWordsJson(trie, wordsPath, stats);
+    printStats(wordsPath, stats);
+
+    auto size = builder.write(output);
+    std::cout << output << ": " << builder.numRecords() << " records, "
+              << builder.numTranslations() << " translations, "
+              << builder.payloadsSize() << " bytes of payloads in " << size
+              << " bytes, " << stats.missing << " words not in trie, "
+              << stats.invalid << " invalid entries" << std::endl;
+    return 0;
+}
+
+// Pinyin keys get their own trie. The glosses are stored in the words.bin
+// format, weighted by the most frequent English gloss so that partial
+// pinyin can be ranked.
+int compilePinyin(const char *wordsTriePath, const char *wordsPath,
+                  const char *cedictPath, const char *trieOutput,
+                  const char *output) {
+    marisa::Trie wordsTrie;
+    wordsTrie.load(wordsTriePath);
+    WordStore words;
+    words.load(wordsPath);
+    marisa::Trie trie;
+    JsonStats stats;
+    auto builder =
+        compilePinyinJson(wordsTrie, words, cedictPath, trie, stats);
+    printStats(cedictPath, stats);
+
+    trie.save(trieOutput);
+    auto size = builder.write(output);
+    std::cout << output << ": " << builder.numRecords() << " pinyin keys, "
+              << builder.numTranslations() << " glosses, "
+              << builder.payloadsSize() << " bytes of payloads in " << size
+              << " bytes" << std::endl;
+    return 0;
+}
+
+// Reads lines of "word<TAB>count" into keyset, weighted by count. Words must
+// also be listed once.
+std::vector<double> readWordList(const std::string &path,
+                                 marisa::Keyset &keyset, Report &report) {
+    std::vector<double> frequencies;
+    std::unordered_map<std::string, size_t> seen;
+    auto where = [&path](size_t line) {
+        return path + ":" + std::to_string(line) + ": ";
+    };
+    readWordCounts(
+        path,
+        [&](size_t line, std::string_view word, double count) {
+            auto [iter, inserted] = seen.try_emplace(std::string(word), line);
+            if (!inserted) {
+                report.error(where(line) + std::string(word) +
+                             " is already listed on line " +
+                             std::to_string(iter->second));
+                return;
+            }
+            keyset.push_back(word.data(), word.size(),
+                             static_cast<float>(count));
+            frequencies.push_back(count);
+        },
+        [&](size_t line, const std::string &message) {
+            report.error(where(line) + message);
+        });
+    return frequencies;
+}
+
+// Compiles every dictionary file from its sources in one pass, so that
+// they always agree. The trie is weighted by the counts of the word list,
+// which arranges the children of each node most frequent first, so the
+// words typed most share the nodes looked at first. The counts are also
+// the frequencies the words are ranked by. words.json supplies the IPA and
+// translations. The completion indexes of both tries are built here too,
+// so that the addon maps them instead of building its own copy. The files
+// only depend on the sources, and are read back once written to check
+// them.
+int build(const std::string &wordList, const std::string &wordsJson,
+          const std::string &cedictJson, const std::filesystem::path &dir) {
+    Timer total;
+    Report report;
+    auto triePath = (dir / "google_227800_words.bin").string();
+    auto wordsPath = (dir / "words.bin").string();
+    auto pinyinTriePath = (dir / "cedict.trie").string();
+    auto pinyinPath = (dir / "cedict.bin").string();
+    auto completionPath = (dir / "words.idx").string();
+    auto pinyinCompletionPath = (dir / "cedict.idx").string();
+
+    Timer timer;
+    marisa::Keyset keyset;
+    auto frequencies = readWordList(wordList, keyset, report);
+    if (report.errors()) {
+        std::cerr << wordList << ": " << report.errors() << " errors"
+                  << std::endl;
+        return 1;
+    }
+    marisa::Trie trie;
+    trie.build(keyset, MARISA_WEIGHT_ORDER);
+    trie.save(triePath.c_str());
+    printSize(triePath, std::to_string(trie.num_keys()) + " words",
+              timer.seconds());
+
+    timer = Timer();
+    JsonStats stats;
+    auto builder = compileWordsJson(trie, wordsJson, stats);
+    printStats(wordsJson.c_str(), stats);
+    report.warnings("entries of " + wordsJson + " not in " + wordList,
+                    stats.missing);
+    report.warnings("invalid entries in " + wordsJson, stats.invalid);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < keyset.size(); ++i) {
+        auto id = keyset[i].id();
+        auto frequency = builder.frequency(id);
+        mismatches += frequency != 0 && frequency != frequencies[i];
+        builder.setFrequency(id, frequencies[i]);
+    }
+    report.warnings("frequencies of " + wordsJson + " overridden by " +
+                        wordList,
+                    mismatches);
+    auto image = builder.serialize();
+    writeFile(wordsPath, image);
+    printSize(wordsPath,
+              std::to_string(builder.numTranslations()) + " translations",
+              timer.seconds());
+
+    timer = Timer();
+    WordStore words;
+    words.assign(std::move(image));
+    JsonStats pinyinStats;
+    marisa::Trie pinyinTrie;
+    auto pinyinBuilder = compilePinyinJson(trie, words, cedictJson,
+                                           pinyinTrie, pinyinStats);
+    printStats(cedictJson.c_str(), pinyinStats);
+    report.warnings("invalid entries in " + cedictJson, pinyinStats.invalid);
+    pinyinTrie.save(pinyinTriePath.c_str());
+    auto pinyinImage = pinyinBuilder.serialize();
+    writeFile(pinyinPath, pinyinImage);
+    printSize(pinyinPath,
+              std::to_string(pinyinBuilder.numRecords()) + " pinyin keys",
+              timer.seconds());
+
+    timer = Timer();
+    writeFile(completionPath,
+              CompletionIndex::serialize(
+                  trie, [&words](std::string_view, uint32_t id) {
+                      return words.frequency(id);
+                  }));
+    writeFile(pinyinCompletionPath,
+              CompletionIndex::serialize(
+                  pinyinTrie, [&pinyinBuilder](std::string_view, uint32_t id) {
+                      return pinyinBuilder.frequency(id);
+                  }));
+    printSize(completionPath, "completion index", timer.seconds());
+
+    // Read back the way the addon does.
+    marisa::Trie checkTrie;
+    checkTrie.mmap(triePath.c_str());
+    WordStore checkWords;
+    checkWords.load(wordsPath);
+    marisa::Trie checkPinyinTrie;
+    checkPinyinTrie.mmap(pinyinTriePath.c_str());
+    WordStore checkPinyin;
+    checkPinyin.load(pinyinPath);
+    CompletionIndex checkCompletion;
+    checkCompletion.load(completionPath);
+    CompletionIndex checkPinyinCompletion;
+    checkPinyinCompletion.load(pinyinCompletionPath);
+    if (checkTrie.num_keys() != frequencies.size() ||
+        checkWords.size() != checkTrie.num_keys() ||
+        checkPinyin.size() != checkPinyinTrie.num_keys() ||
+        checkCompletion.size() != checkTrie.num_keys() ||
+        checkPinyinCompletion.size() != checkPinyinTrie.num_keys()) {
+        report.error("the files written do not match each other");
+    }
+
+    std::cout << dir.string() << ": built in " << total.seconds() << " s, "
+              << report.errors() << " errors, " << report.warnings()
+              << " warnings" << std::endl;
+    return report.errors() ? 1 : 0;
+}
+
+// Counts adjacent pairs of trie words in a plain text corpus. Anything but
+// letters and blanks, such as punctuation or a line break, ends a run of
+// words, as does a word that is not in the trie. Followers seen fewer than
+// MinCount times are dropped, and at most MaxFollowers are kept per word.
+int compileBigram(const char *triePath, const char *corpusPath,
+                  const char *output) {
+    constexpr uint32_t MinCount = 2;
+    constexpr size_t MaxFollowers = 16;
+    constexpr uint32_t NoWord = UINT32_MAX;
+
+    marisa::Trie trie;
+    trie.load(triePath);
+    if (trie.num_keys() >= (1U << 24)) {
+        throw std::runtime_error("Too many keys for bigram.bin");
+    }
+    std::ifstream corpus(corpusPath, std::ios::binary);
+    if (!corpus) {
+        throw std::runtime_error(std::string("Failed to open ") + corpusPath);
+    }
+
+    std::unordered_map<uint64_t, uint32_t> pairs;
+    std::vector<uint64_t> totals(trie.num_keys());
+    marisa::Agent agent;
+    std::string word;
+    uint32_t previous = NoWord;
+    size_t tokens = 0;
+    auto endWord = [&]() {
+        if (word.empty()) {
+            return;
+        }
+        ++tokens;
+        agent.set_query(word.data(), word.size());
+        auto current = trie.lookup(agent) ? agent.key().id() : NoWord;
+        if (previous != NoWord && current != NoWord) {
+            ++pairs[uint64_t(previous) << 32 | current];
+            ++totals[previous];
+        }
+        previous = current;
+        word.clear();
+    };
+    char c;
+    while (corpus.get(c)) {
+        if (std::isalpha(static_cast<unsigned char>(c))) {
+            word += std::tolower(static_cast<unsigned char>(c));
+            continue;
+        }
+        endWord();
+        if (c != ' ' && c != '\t') {
+            previous = NoWord;
+        }
+    }
+    endWord();
+
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> followers(
+        trie.num_keys());
+    for (auto [pair, count] : pairs) {
+        if (count >= MinCount) {
+            followers[pair >> 32].emplace_back(count, pair & UINT32_MAX);
+        }
+    }
+    std::vector<uint32_t> offsets;
+    std::vector<format::BigramEntry> entries;
+    offsets.reserve(followers.size() + 1);
+    for (size_t id = 0; id < followers.size(); ++id) {
+        offsets.push_back(entries.size());
+        auto &list = followers[id];
+        std::sort(list.begin(), list.end(), std::greater<>());
+        list.resize(std::min(list.size(), MaxFollowers));
+        for (auto [count, next] : list) {
+            auto weight = std::lround(
+                255 + 8 * std::log2(double(count) / totals[id]));
+            entries.push_back(
+                {next, static_cast<uint32_t>(std::clamp(weight, 0L, 255L))});
+        }
+    }
+    offsets.push_back(entries.size());
+
+    format::BigramFileHeader header{};
+    std::memcpy(header.magic, format::BigramMagic, sizeof(header.magic));
+    header.version = format::BigramVersion;
+    header.numKeys = trie.num_keys();
+    header.numEntries = entries.size();
+    header.offsetsOffset = sizeof(header);
+    header.entriesOffset =
+        header.offsetsOffset + offsets.size() * sizeof(uint32_t);
+    std::ofstream out(output, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    writeArray(out, offsets);
+    writeArray(out, entries);
+    if (!out) {
+        throw std::runtime_error(std::string("Failed to write ") + output);
+    }
+    std::cout << output << ": " << tokens << " tokens, " << pairs.size()
+              << " distinct pairs, " << entries.size() << " kept"
+              << std::endl;
+    return 0;
+}
+
+// Writes the completion index of a trie, ranked by the frequencies of the
+// records compiled for it, so that the addon maps it instead of building
+// its own copy.
+int compileIndex(const char *triePath, const char *recordsPath,
+                 const char *output) {
+    marisa::Trie trie;
+    trie.load(triePath);
+    WordStore records;
+    records.load(recordsPath);
+    if (records.size() != trie.num_keys()) {
+        throw std::runtime_error(std::string(recordsPath) +
+                                 " does not match " + triePath);
+    }
+    auto image = CompletionIndex::serialize(
+        trie, [&records](std::string_view, uint32_t id) {
+            return records.frequency(id);
+        });
+
+    std::ofstream out(output, std::ios::binary);
+    out.write(image.data(), image.size());
+    if (!out) {
+        throw std::runtime_error(std::string("Failed to write ") + output);
+    }
+    std::cout << output << ": " << trie.num_keys() << " keys in "
+              << image.size() << " bytes" << std::endl;
+    return 0;
+}
+
+int usage(const char *argv0) {
+    std::cerr << "Usage: " << argv0
+              << " build <words.txt> <words.json> <cedict.json> <output-dir>\n"
+              << "       " << argv0 << " words <trie> <words.json> <output>\n"
+              << "       " << argv0
+              << " pinyin <trie> <words.bin> <cedict.json> <output-trie> "
+                 "<output>\n"
+              << "       " << argv0 << " index <trie> <words.bin> <output>\n"
+              << "       " << argv0 << " bigram <trie> <corpus.txt> <output>"
+              << std::endl;
+    return 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        return usage(argv[0]);
+    }
+    std::string_view command = argv[1];
+    try {
+        if (command == "build" && argc == 6) {
+            return build(argv[2], argv[3], argv[4], argv[5]);
+        }
+        if (command == "words" && argc == 5) {
+            return compileWords(argv[2], argv[3], argv[4]);
+        }
+        if (command == "pinyin" && argc == 7) {
+            return compilePinyin(argv[2], argv[3], argv[4], argv[5], argv[6]);
+        }
+        if (command == "index" && argc == 5) {
+            return compileIndex(argv[2], argv[3], argv[4]);
+        }
+        if (command == "bigram" && argc == 5) {
+            return compileBigram(argv[2], argv[3], argv[4]);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return usage(argv[0]);
+}